@@ -197,7 +197,12 @@ static void usage_NORETURN ( Bool debug_help )
 "         where hint is one of:\n"
 "           lax-ioctls lax-doors fuse-compatible enable-outer\n"
 "           no-inner-prefix no-nptl-pthread-stackcache fallback-llsc none\n"
-"    --fair-sched=no|yes|try|random   schedule threads fairly on multicore systems [no]\n"
+"    --fair-sched=no|yes|try|random|pct   schedule threads fairly on multicore systems [no]\n"
+"    --pct-depth=<number>      bug depth for --fair-sched=pct; the scheduler\n"
+"                              inserts <number>-1 priority change points [3]\n"
+"    --pct-sblocks=<number>    expected number of superblocks run by the\n"
+"                              program, from which the --fair-sched=pct\n"
+"                              change points are drawn [1000000]\n"
 "    --kernel-variant=variant1,variant2,...\n"
 "         handle non-standard kernel variants [none]\n"
 "         where variant is one of:\n"
@@ -672,10 +677,15 @@ void main_process_cmd_line_options( void )
             VG_(clo_fair_sched) = disable_fair_sched;
          else if (VG_(strcmp)(tmp_str, "random") == 0)
             VG_(clo_fair_sched) = random_sched;
+         else if (VG_(strcmp)(tmp_str, "pct") == 0)
+            VG_(clo_fair_sched) = pct_sched;
          else
             VG_(fmsg_bad_option)(arg,
-               "Bad argument, should be 'yes', 'try' or 'no'\n");
+               "Bad argument, should be 'yes', 'try', 'no', 'random' or 'pct'\n");
       }
+      else if VG_BINT_CLO(arg, "--pct-depth",        VG_(clo_pct_depth), 1, 64) {}
+      else if VG_BINT_CLO(arg, "--pct-sblocks",      VG_(clo_pct_sblocks),
+                                                     1, 1000000000000LL) {}
       else if VG_BOOL_CLO(arg, "--trace-sched",      VG_(clo_trace_sched)) {}
       else if VG_BOOL_CLO(arg, "--trace-signals",    VG_(clo_trace_signals)) {}
       else if VG_BOOL_CLO(arg, "--trace-symtab",     VG_(clo_trace_symtab)) {}
@@ -0,0 +1,312 @@
+/*--------------------------------------------------------------------*/
+/*--- Linux PCT scheduler lock implementation           pct-lock.c ---*/
+/*---                                                              ---*/
+/*--- Probabilistic Concurrency Testing (Burckhardt et al., 2010): ---*/
+/*--- the waiting thread with the highest priority is always the   ---*/
+/*--- next to run, where each thread is given a random priority    ---*/
+/*--- and the running thread drops to the lowest priority at d - 1 ---*/
+/*--- randomly chosen points of the run.                           ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Valgrind, a dynamic binary instrumentation
+   framework.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#include "pub_core_basics.h"
+#include "pub_core_libcassert.h"
+#include "pub_core_libcbase.h"
+#include "pub_core_libcprint.h"
+#include "pub_core_syscall.h"
+#include "pub_core_vki.h"
+#include "pub_core_vkiscnums.h"    // __NR_futex
+#include "pub_core_libcproc.h"
+#include "pub_core_mallocfree.h"
+#include "pub_core_options.h"
+#include "pub_core_threadstate.h"
+#include "priv_sched-lock.h"
+#include "priv_sched-lock-impl.h"
+
+struct pct_thread {
+   Int tid;
+   // Higher runs first; initial priorities are >= VG_(clo_pct_depth) and the
+   // i-th change point lowers the running thread to VG_(clo_pct_depth) - i.
+   Long priority;
+   // Futex word; set to 1 when the lock is handed to this thread.
+   volatile UInt go;
+   volatile Bool waiting;
+};
+
+struct sched_lock {
+   volatile Int spin;
+   volatile Int owner;
+   struct pct_thread **threads;
+   UInt num_threads;
+   UInt max_threads;
+   // Whether priorities and change points have been drawn
+   Bool initialized;
+   ULong *change_points;
+   UInt num_change_points;
+   UInt next_change_point;
+   // Number of consecutive time slices the owner kept the lock
+   UInt num_kept;
+};
+
+extern UInt VG_(quantum_seed);
+extern UInt VG_(scheduling_quantum);
+
+// A thread kept running this many superblocks while others wait is assumed
+// to be spinning on one of them, and drops below all of them.
+#define PCT_STARVATION_LIMIT 100000
+
+static void acquire(struct sched_lock *p) {
+   while (__sync_lock_test_and_set(&p->spin, 1) != 0) {
+      while (p->spin) {
+         __sync_synchronize();
+      }
+   }
+}
+
+static void release(struct sched_lock *p) {
+   __sync_lock_release(&p->spin);
+}
+
+static const HChar *get_sched_lock_name(void)
+{
+   return "pct lock";
+}
+
+static struct sched_lock *create_sched_lock(void)
+{
+   struct sched_lock *p = VG_(malloc)("sched_lock", sizeof(*p));
+   VG_(memset)(p, 0, sizeof(*p));
+   return p;
+}
+
+static void destroy_sched_lock(struct sched_lock *p)
+{
+   for (UInt i = 0; i < p->num_threads; i++) {
+      VG_(free)(p->threads[i]);
+   }
+   VG_(free)(p->threads);
+   VG_(free)(p->change_points);
+   VG_(free)(p);
+}
+
+static int get_sched_lock_owner(struct sched_lock *p)
+{
+   return p->owner;
+}
+
+static Long draw_priority(void)
+{
+   return VG_(clo_pct_depth) + VG_(random)(&VG_(quantum_seed));
+}
+
+// Must hold spin lock
+static struct pct_thread *get_thread(struct sched_lock *p, Int tid)
+{
+   for (UInt i = 0; i < p->num_threads; i++) {
+      if (p->threads[i]->tid == tid) {
+         return p->threads[i];
+      }
+   }
+   if (p->num_threads == p->max_threads) {
+      p->max_threads = VG_MAX(8, p->max_threads * 2);
+      p->threads = VG_(realloc)("sched_lock->threads", p->threads, p->max_threads * sizeof(struct pct_thread *));
+   }
+   struct pct_thread *t = VG_(malloc)("pct_thread", sizeof(*t));
+   t->tid = tid;
+   t->priority = p->initialized ? draw_priority() : 0;
+   t->go = 0;
+   t->waiting = False;
+   p->threads[p->num_threads++] = t;
+   return t;
+}
+
+/* Draws the priority of each thread seen so far and the d - 1 change
+   points. Deferred to the first time slice of client code, so that the
+   tool has seeded VG_(quantum_seed) by then. */
+static void initialize(struct sched_lock *p)
+{
+   for (UInt i = 0; i < p->num_threads; i++) {
+      p->threads[i]->priority = draw_priority();
+   }
+   p->num_change_points = VG_(clo_pct_depth) > 0 ? VG_(clo_pct_depth) - 1 : 0;
+   p->change_points = VG_(malloc)("sched_lock->change_points", VG_MAX(1, p->num_change_points) * sizeof(ULong));
+   for (UInt i = 0; i < p->num_change_points; i++) {
+      ULong point = (((ULong) VG_(random)(&VG_(quantum_seed)) << 32) | VG_(random)(&VG_(quantum_seed))) % VG_(clo_pct_sblocks) + 1;
+      // Insertion sort; there are only a handful
+      UInt j = i;
+      for (; j > 0 && p->change_points[j - 1] > point; j--) {
+         p->change_points[j] = p->change_points[j - 1];
+      }
+      p->change_points[j] = point;
+   }
+   p->next_change_point = 0;
+   p->initialized = True;
+}
+
+// Must hold spin lock; the waiting thread with the highest priority, or NULL
+static struct pct_thread *highest_waiter(struct sched_lock *p)
+{
+   struct pct_thread *best = NULL;
+   for (UInt i = 0; i < p->num_threads; i++) {
+      struct pct_thread *t = p->threads[i];
+      if (t->waiting && (!best || t->priority > best->priority)) {
+         best = t;
+      }
+   }
+   return best;
+}
+
+// Must hold spin lock; the waiting thread with the lowest priority, or NULL
+static struct pct_thread *lowest_waiter(struct sched_lock *p)
+{
+   struct pct_thread *worst = NULL;
+   for (UInt i = 0; i < p->num_threads; i++) {
+      struct pct_thread *t = p->threads[i];
+      if (t->waiting && (!worst || t->priority < worst->priority)) {
+         worst = t;
+      }
+   }
+   return worst;
+}
+
+// Must hold spin lock
+static void hand_off(struct sched_lock *p, struct pct_thread *t)
+{
+   t->waiting = False;
+   p->owner = t->tid;
+   p->num_kept = 0;
+   t->go = 1;
+   __sync_synchronize();
+   SysRes sres = VG_(do_syscall3)(__NR_futex, (UWord) &t->go,
+                                  VKI_FUTEX_WAKE | VKI_FUTEX_PRIVATE_FLAG, 1);
+   vg_assert(!sr_isError(sres));
+}
+
+static void acquire_sched_lock(struct sched_lock *p)
+{
+   Int tid = VG_(gettid)();
+   acquire(p);
+   if (p->owner == 0) {
+      p->owner = tid;
+      release(p);
+      return;
+   }
+   struct pct_thread *t = get_thread(p, tid);
+   t->go = 0;
+   t->waiting = True;
+   release(p);
+   while (True) {
+      __sync_synchronize();
+      if (t->go) break;
+      SysRes sres = VG_(do_syscall3)(__NR_futex, (UWord) &t->go,
+                                     VKI_FUTEX_WAIT | VKI_FUTEX_PRIVATE_FLAG, 0);
+      if (sr_isError(sres) && sr_Err(sres) != VKI_EAGAIN && sr_Err(sres) != VKI_EINTR) {
+         VG_(printf)("futex_wait() returned error code %lu\n", sr_Err(sres));
+         vg_assert(False);
+      }
+   }
+   vg_assert(p->owner == tid);
+}
+
+static void release_sched_lock(struct sched_lock *p)
+{
+   acquire(p);
+   struct pct_thread *next;
+   if (p->initialized) {
+      next = highest_waiter(p);
+   } else {
+      // Before client code runs; hand to whoever is waiting
+      next = NULL;
+      for (UInt i = 0; i < p->num_threads && !next; i++) {
+         if (p->threads[i]->waiting) next = p->threads[i];
+      }
+   }
+   if (next) {
+      hand_off(p, next);
+   } else {
+      p->owner = 0;
+   }
+   release(p);
+}
+
+/* Called by the owner at the end of each time slice. Applies any change
+   points passed by 'bbs_done' to the owner, then decides whether the owner
+   still has the highest priority among the threads wanting to run. */
+static Bool should_yield(struct sched_lock *p, ULong bbs_done)
+{
+   acquire(p);
+   if (!p->initialized) {
+      initialize(p);
+   }
+   struct pct_thread *self = get_thread(p, VG_(gettid)());
+   while (p->next_change_point < p->num_change_points
+          && bbs_done >= p->change_points[p->next_change_point]) {
+      p->next_change_point++;
+      self->priority = (Long) VG_(clo_pct_depth) - p->next_change_point;
+   }
+   struct pct_thread *next = highest_waiter(p);
+   Bool yield = False;
+   if (next) {
+      if (next->priority > self->priority) {
+         yield = True;
+      } else if (++p->num_kept * VG_(scheduling_quantum) >= PCT_STARVATION_LIMIT) {
+         // The thread it spins on need not be the highest waiter, so let
+         // every waiter run before it does again
+         self->priority = lowest_waiter(p)->priority - 1;
+         yield = True;
+      }
+   }
+   release(p);
+   return yield;
+}
+
+static void exit_sched_lock(struct sched_lock *p)
+{
+   Int tid = VG_(gettid)();
+   acquire(p);
+   for (UInt i = 0; i < p->num_threads; i++) {
+      if (p->threads[i]->tid == tid) {
+         VG_(free)(p->threads[i]);
+         p->threads[i] = p->threads[--p->num_threads];
+         break;
+      }
+   }
+   release(p);
+   release_sched_lock(p);
+}
+
+const struct sched_lock_ops ML_(pct_lock_ops) = {
+   .get_sched_lock_name  = get_sched_lock_name,
+   .create_sched_lock    = create_sched_lock,
+   .destroy_sched_lock   = destroy_sched_lock,
+   .get_sched_lock_owner = get_sched_lock_owner,
+   .acquire_sched_lock   = acquire_sched_lock,
+   .release_sched_lock   = release_sched_lock,
+   .exit_sched_lock      = exit_sched_lock,
+   .should_yield         = should_yield,
+};
+
+/*--------------------------------------------------------------------*/
+/*--- end                                                          ---*/
+/*--------------------------------------------------------------------*/
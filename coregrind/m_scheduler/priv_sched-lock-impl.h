@@ -44,11 +44,15 @@ struct sched_lock_ops {
    // NEW: Called when a thread exits and is a way to notify
    // the scheduler. Used in the randomized lock.
    void (*exit_sched_lock)(struct sched_lock *p); 
+   // Optional: called by the owner when its time slice ends; returns False
+   // to keep running without releasing the lock. Used in the PCT lock.
+   Bool (*should_yield)(struct sched_lock *p, ULong bbs_done);
 };
 
 extern const struct sched_lock_ops ML_(generic_sched_lock_ops);
 extern const struct sched_lock_ops ML_(linux_ticket_lock_ops);
 extern const struct sched_lock_ops ML_(random_lock_ops);
+extern const struct sched_lock_ops ML_(pct_lock_ops);
 
 #endif   // __PRIV_SCHED_LOCK_IMPL_H
 
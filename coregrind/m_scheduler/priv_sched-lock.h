@@ -36,7 +36,7 @@
 
 struct sched_lock;
 
-enum SchedLockType { sched_lock_generic, sched_lock_ticket, sched_random_lock };
+enum SchedLockType { sched_lock_generic, sched_lock_ticket, sched_random_lock, sched_pct_lock };
 
 Bool ML_(set_sched_lock_impl)(const enum SchedLockType t);
 const HChar *ML_(get_sched_lock_name)(void);
@@ -45,6 +45,7 @@ void ML_(destroy_sched_lock)(struct sched_lock *p);
 int ML_(get_sched_lock_owner)(struct sched_lock *p);
 void ML_(acquire_sched_lock)(struct sched_lock *p);
 void ML_(release_sched_lock)(struct sched_lock *p);
+Bool ML_(should_yield_sched_lock)(struct sched_lock *p, ULong bbs_done);
 
 #endif   // __PRIV_SCHED_LOCK_H
 
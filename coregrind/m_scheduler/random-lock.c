@@ -53,15 +53,15 @@ struct semaphore {
    volatile unsigned count; 
 };
 
-void semaphore_init(struct semaphore *sema) {
+static void semaphore_init(struct semaphore *sema) {
    sema->count = 0;
    INNER_REQUEST(ANNOTATE_BENIGN_RACE_SIZED(&sema->count, sizeof(sema->count), ""));
 }
 
-void semaphore_deinit(struct semaphore *sema) {}
+static void semaphore_deinit(struct semaphore *sema) {}
 
 /* get a token */
-void semaphore_await(struct semaphore *sema) {
+static void semaphore_await(struct semaphore *sema) {
    while (True) {
       __sync_synchronize();
       if (sema->count == 1) break;
@@ -73,13 +73,13 @@ void semaphore_await(struct semaphore *sema) {
    }
 }
 
-void semaphore_reset(struct semaphore *sema) {
+static void semaphore_reset(struct semaphore *sema) {
    sema->count = 0;
    __sync_synchronize();
 }
 
 /* put token back */
-void semaphore_signal(struct semaphore *sema) {
+static void semaphore_signal(struct semaphore *sema) {
    sema->count = 1;
    __sync_synchronize();
    SysRes sres = VG_(do_syscall3)(__NR_futex, (UWord)&sema->count,
@@ -92,18 +92,28 @@ void semaphore_signal(struct semaphore *sema) {
 struct semaphore_wrapper {
    struct semaphore sema;
    volatile ThreadId tid;
+   // Index in sched_lock->waiters while waiting
+   UInt idx;
+   // Next free wrapper once no longer waiting
+   struct semaphore_wrapper *next;
 };
 
 // Scheduler lock must be acquired first prior to doing anything, including
 // adding yourself to the list of threads for waiting, and for acquiring the
 // scheduler lock.
 struct sched_lock {
-   int sched_lock;
-   volatile SizeT num_thread_locks;
-   volatile SizeT used_thread_locks;
-   volatile struct semaphore_wrapper **thread_locks;
+   // 0 = unlocked, 1 = locked, 2 = locked with threads parked on it
+   volatile Int sched_lock;
+   // Waiting threads, kept dense so the next owner is a single random index
+   struct semaphore_wrapper **waiters;
+   UInt num_waiters;
+   UInt max_waiters;
+   // Wrappers of threads no longer waiting, reused by the next waiter
+   struct semaphore_wrapper *free_waiters;
    volatile ThreadId owner;
    volatile ThreadId holdout_thread;
+   // The holdout thread's wrapper if it is currently waiting, else NULL
+   struct semaphore_wrapper *holdout_waiter;
    volatile UInt num_holdout;
 };
 
@@ -114,22 +124,37 @@ extern UInt VG_(scheduling_quantum);
 extern ThreadId VG_(running_tid);
 static UInt maximum_holdout;
 
+static void futex_wait(volatile Int *addr, Int val) {
+   SysRes sres = VG_(do_syscall3)(__NR_futex, (UWord) addr, VKI_FUTEX_WAIT | VKI_FUTEX_PRIVATE_FLAG, val);
+   if (sr_isError(sres) && sr_Err(sres) != VKI_EAGAIN && sr_Err(sres) != VKI_EINTR) {
+      VG_(printf)("futex_wait() returned error code %lu\n", sr_Err(sres));
+      vg_assert(False);
+   }
+}
+
+// Three-state futex mutex (Drepper, "Futexes Are Tricky"); contended threads
+// sleep in the kernel rather than spinning while the owner picks a thread.
 static void acquire(struct sched_lock *lock) {
-   if (__sync_lock_test_and_set(&lock->sched_lock, 1) == 0) {
+   Int c = __sync_val_compare_and_swap(&lock->sched_lock, 0, 1);
+   if (c == 0) {
       return;
    }
-
-   while (True) {
-      __sync_synchronize();
-      if (lock->sched_lock == 0 && __sync_lock_test_and_set(&lock->sched_lock, 1) == 0) {
-         return;
-      }
+   if (c != 2) {
+      c = __sync_lock_test_and_set(&lock->sched_lock, 2);
+   }
+   while (c != 0) {
+      futex_wait(&lock->sched_lock, 2);
+      c = __sync_lock_test_and_set(&lock->sched_lock, 2);
    }
 }
 
 static void release(struct sched_lock *lock) {
-   lock->sched_lock = 0;
-   __sync_synchronize();
+   if (__sync_fetch_and_sub(&lock->sched_lock, 1) != 1) {
+      lock->sched_lock = 0;
+      __sync_synchronize();
+      SysRes sres = VG_(do_syscall3)(__NR_futex, (UWord) &lock->sched_lock, VKI_FUTEX_WAKE | VKI_FUTEX_PRIVATE_FLAG, 1);
+      vg_assert(!sr_isError(sres));
+   }
 }
 
 static const HChar *get_sched_lock_name(void)
@@ -144,29 +169,31 @@ static struct sched_lock *create_sched_lock(void)
 
    p = VG_(malloc)("sched_lock", sizeof(*p));
 
-   ML_(sema_init)(&p->sched_lock);
    p->owner = VG_INVALID_THREADID;
    p->holdout_thread = VG_INVALID_THREADID;
+   p->holdout_waiter = NULL;
    p->num_holdout = 0;
-   p->thread_locks = NULL;
-   p->num_thread_locks = 0;
-   p->used_thread_locks = 0;
+   p->waiters = NULL;
+   p->num_waiters = 0;
+   p->max_waiters = 0;
+   p->free_waiters = NULL;
    p->sched_lock = 0;
 
    INNER_REQUEST(ANNOTATE_RWLOCK_CREATE(p));
-   // VG_(emit)("Hard Limit is %d\n", VG_(fd_hard_limit));
    return p;
 }
 
 static void destroy_sched_lock(struct sched_lock *p)
 {
    INNER_REQUEST(ANNOTATE_RWLOCK_DESTROY(p));
-   ML_(sema_deinit)(&p->sched_lock);
-   for (int i = 0; i < p->num_thread_locks; i++) {
-      semaphore_deinit(&p->thread_locks[i]->sema);
-      VG_(free)(p->thread_locks[i]);
+   tl_assert2(p->num_waiters == 0, "Destroying scheduler lock with %u waiting threads", p->num_waiters);
+   while (p->free_waiters) {
+      struct semaphore_wrapper *w = p->free_waiters;
+      p->free_waiters = w->next;
+      semaphore_deinit(&w->sema);
+      VG_(free)(w);
    }
-   VG_(free)(p->thread_locks);
+   VG_(free)(p->waiters);
    VG_(free)(p);
 }
 
@@ -174,43 +201,75 @@ static int get_sched_lock_owner(struct sched_lock *p) {
    return p->owner;
 }
 
+// Must hold lock!!! Appends the calling thread to the waiters.
+static struct semaphore_wrapper *add_waiter(struct sched_lock *p, ThreadId tid) {
+   if (p->num_waiters == p->max_waiters) {
+      p->max_waiters = VG_MAX(8, p->max_waiters * 2);
+      p->waiters = VG_(realloc)("sched_lock->waiters", p->waiters, p->max_waiters * sizeof(struct semaphore_wrapper *));
+   }
+   struct semaphore_wrapper *w = p->free_waiters;
+   if (w) {
+      p->free_waiters = w->next;
+   } else {
+      w = VG_(malloc)("sema_wrapper", sizeof(struct semaphore_wrapper));
+      semaphore_init(&w->sema);
+   }
+   w->tid = tid;
+   w->idx = p->num_waiters;
+   w->next = NULL;
+   semaphore_reset(&w->sema);
+   p->waiters[p->num_waiters++] = w;
+   if (tid == p->holdout_thread) {
+      p->holdout_waiter = w;
+   }
+   return w;
+}
+
+// Must hold lock!!! Removes a waiter by moving the last one into its slot.
+static void remove_waiter(struct sched_lock *p, struct semaphore_wrapper *w) {
+   struct semaphore_wrapper *last = p->waiters[--p->num_waiters];
+   p->waiters[w->idx] = last;
+   last->idx = w->idx;
+   if (w == p->holdout_waiter) {
+      p->holdout_waiter = NULL;
+   }
+}
+
+// Must hold lock!!! Makes the waiter the owner and wakes it.
+static void hand_off(struct sched_lock *p, struct semaphore_wrapper *w) {
+   remove_waiter(p, w);
+   p->owner = w->tid;
+   semaphore_signal(&w->sema);
+}
+
 // Must hold lock!!!
 static void set_holdout_thread(struct sched_lock *p) {
    tl_assert2(p->holdout_thread == VG_INVALID_THREADID, "Attempted to set holdout thread when thread %lu has %lu scheduling decisions left...", p->holdout_thread, p->num_holdout);
    
-   // Only randomly sample a holdout thread if there are other threads waiting
-   if (p->used_thread_locks) {
-      UInt ix = VG_(random)(&VG_(quantum_seed)) % p->used_thread_locks + 1;
-      if (ix == p->used_thread_locks) {
+   // Only randomly sample a holdout thread if there are other threads waiting;
+   // index num_waiters stands for the releasing thread itself.
+   if (p->num_waiters) {
+      UInt ix = VG_(random)(&VG_(quantum_seed)) % (p->num_waiters + 1);
+      if (ix == p->num_waiters) {
          p->holdout_thread = VG_(gettid)();
+         p->holdout_waiter = NULL;
          tl_assert2(p->holdout_thread != VG_INVALID_THREADID, "VG_(running_tid)() == VG_INVALID_THREADID!!!");
       } else {
-         UInt iterations = ix;
-         for (int i = 0; i < p->num_thread_locks; i++) {
-            if (iterations == 0 && p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID) {
-               p->holdout_thread = p->thread_locks[i]->tid;
-               break;
-            }
-            if (p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID) {
-               iterations--;
-            }
-         }
+         p->holdout_waiter = p->waiters[ix];
+         p->holdout_thread = p->holdout_waiter->tid;
       }
       p->num_holdout = VG_(random)(&VG_(quantum_seed)) % maximum_holdout + 1;
-      // VG_(emit)("Thread #%lu is the new holdout thread for %lu scheduling changes...\n", p->holdout_thread, p->num_holdout);
    }
 }
 
 static void release_sched_lock(struct sched_lock *p) {
    acquire(p);
-   tl_assert2(p->used_thread_locks - (p->holdout_thread == VG_(gettid)() ? 0 : 1) >= 0, "Bad used_thread_locks=%lu", p->used_thread_locks);
    
    if (p->holdout_thread != VG_INVALID_THREADID) {
       p->num_holdout--;
-      tl_assert(p->num_holdout >= 0);
       if (p->num_holdout == 0) {
-         // VG_(emit)("Thread#%lu no longer holdout...\n", p->holdout_thread);
          p->holdout_thread = VG_INVALID_THREADID;
+         p->holdout_waiter = NULL;
       }
    }
    // Pick a holdout thread if other threads are waiting...
@@ -218,64 +277,20 @@ static void release_sched_lock(struct sched_lock *p) {
       set_holdout_thread(p);
    }
    // Check if anyone needs access
-   if (p->used_thread_locks) {
-      // VG_(emit)("p->user_thread_locks(%lu) - (p->holdout_thread(%lu) == VG_(gettid)()(%lu) ? 0 : 1)(%lu)\n",
-      //    p->used_thread_locks, p->holdout_thread, VG_(gettid)(), p->holdout_thread == VG_(gettid)()
-      // );
-      UInt iterations = VG_(random)(&VG_(quantum_seed)) % p->used_thread_locks;
-      // VG_(emit)("Iterations=%lu\n", iterations);
-      Bool isGood = False;
-      Bool loopedOnce = False;
-      for (int i = 0; i < p->num_thread_locks; i++) {
-         if (iterations == 0 && p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID && p->thread_locks[i]->tid != p->holdout_thread) {
-            p->owner = p->thread_locks[i]->tid;
-            semaphore_signal(&p->thread_locks[i]->sema);
-            isGood = True;
-            break;
-         }
-         if (p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID && iterations > 0) {
-            iterations--;
-         }
-      }
-      if (!isGood) {
-         for (int i = 0; i < p->num_thread_locks; i++) {
-            if (iterations == 0 && p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID && p->thread_locks[i]->tid != p->holdout_thread) {
-               p->owner = p->thread_locks[i]->tid;
-               semaphore_signal(&p->thread_locks[i]->sema);
-               isGood = True;
-               break;
-            }
-            if (p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID && iterations > 0) {
-               iterations--;
-            }
-         }
-      }
-      
-      // if (!isGood && p->used_thread_locks != 1) {
-      //    for (int i = 0; i < p->num_thread_locks; i++) {
-      //       VG_(emit)("%lu -> %lu\n", i, p->thread_locks[i] ? p->thread_locks[i]->tid : 0);
-      //    }
-      // }
-      // VG_(emit)("loopedOnce=%lu, iterations=%lu\n", loopedOnce, iterations);
-
-      tl_assert2(isGood || p->used_thread_locks == 1, "Exhausted without finding next thread to run, and have used_thread_locks=%lu", p->used_thread_locks);
-      if (!isGood) {
-         // VG_(emit)("Thread#%lu: No waiters (holdout)... (holdout=Thread#%lu,used_thread_locks=%lu)\n", VG_(gettid)(), p->holdout_thread, p->used_thread_locks);
-         // No one needs it, just relinquish...
-         for (int i = 0; i < p->num_thread_locks; i++) {
-            if (p->thread_locks[i]->tid != VG_INVALID_THREADID && p->thread_locks[i]->tid) {
-               p->owner = p->thread_locks[i]->tid;
-               semaphore_signal(&p->thread_locks[i]->sema);
-               isGood = True;
-               break;
-            }
-            if (p->thread_locks[i] && p->thread_locks[i]->tid != VG_INVALID_THREADID && iterations > 0) {
-               iterations--;
-            }
+   if (p->num_waiters) {
+      struct semaphore_wrapper *holdout = p->holdout_waiter;
+      if (holdout && p->num_waiters == 1) {
+         // Only the holdout thread wants to run; let it rather than stall
+         hand_off(p, holdout);
+      } else {
+         // Uniform over the waiters other than the holdout thread
+         UInt ix = VG_(random)(&VG_(quantum_seed)) % (p->num_waiters - (holdout ? 1 : 0));
+         if (holdout && ix >= holdout->idx) {
+            ix++;
          }
+         hand_off(p, p->waiters[ix]);
       }
    } else {
-      // VG_(emit)("Thread#%lu: No waiters... (holdout=Thread#%lu,used_thread_locks=%lu)\n", VG_(gettid)(), p->holdout_thread, p->used_thread_locks);
       // No one needs it, just relinquish...
       p->owner = VG_INVALID_THREADID;
    }
@@ -284,68 +299,31 @@ static void release_sched_lock(struct sched_lock *p) {
 
 static void acquire_sched_lock(struct sched_lock *p) {
    acquire(p);
-   // If some other thread owns the lock, add self to wait list.
-   if (p->owner != VG_INVALID_THREADID || p->holdout_thread == VG_(gettid)()) {
-      // Full? Extend!
-      int idx;
-      if (p->num_thread_locks == p->used_thread_locks) {
-         p->num_thread_locks = VG_MAX(1, p->num_thread_locks * 2);
-         struct sched_lock **tmp = VG_(malloc)("sched_lock->thread_locks", p->num_thread_locks * sizeof(struct sched_lock *));
-         for (int i = 0; i < p->used_thread_locks; i++) {
-            tmp[i] = p->thread_locks[i];
-         }
-         for (int i = p->used_thread_locks; i < p->num_thread_locks; i++) {
-            tmp[i] = NULL;
-         }
-         VG_(free)(p->thread_locks);
-         p->thread_locks = tmp;
-         
-         idx = p->used_thread_locks;
-         p->thread_locks[idx] = VG_(malloc)("sema_wrapper", sizeof(struct semaphore_wrapper));
-         semaphore_init(&p->thread_locks[idx]->sema);
-      } else {
-         // Otherwise scan for empty slot
-         for (int i = 0; i < p->num_thread_locks; i++) {
-            if (!p->thread_locks[i]) {
-               idx = i;
-               p->thread_locks[i] = VG_(malloc)("sema_wrapper", sizeof(struct semaphore_wrapper));
-               semaphore_init(&p->thread_locks[i]->sema);
-               break;
-            }
-            if (p->thread_locks[i]->tid == VG_INVALID_THREADID) {
-               idx = i;
-               break;
-            }
-         }
-      }
-
-      // Claim for our own
-      int tid = VG_(gettid)();
-      p->thread_locks[idx]->tid = tid;
-      p->used_thread_locks++;
-      semaphore_reset(&p->thread_locks[idx]->sema);
-      // VG_(emit)("Thread#%lu: Waiting turn (owner=Thread#%lu,holdout=Thread#%lu,num_holdout=%lu)\n", tid, p->owner, p->holdout_thread, p->num_holdout);
+   ThreadId tid = VG_(gettid)();
+   // If some other thread owns the lock, add self to wait list. The holdout
+   // thread takes a free lock too: with no owner, no one else wants to run,
+   // and no release would ever come to hand the lock to it.
+   if (p->owner != VG_INVALID_THREADID) {
+      struct semaphore_wrapper *w = add_waiter(p, tid);
       release(p);
-      semaphore_await(&p->thread_locks[idx]->sema);
+      // The releasing thread removes us from the waiters and makes us owner
+      semaphore_await(&w->sema);
       acquire(p);
-      p->thread_locks[idx]->tid = VG_INVALID_THREADID;
-      p->used_thread_locks--;
-      tl_assert2(p->owner == tid, "The owner of scheduler lock is not (%ld,%ld) but is instead %ld!\n", VG_(gettid)(), tid,  p->owner);
-      // VG_(emit)("Thread#%lu: Obtained turn (holdout=Thread#%lu,num_holdout=%lu)\n", tid, p->holdout_thread, p->num_holdout);
+      tl_assert2(p->owner == tid, "The owner of scheduler lock is not %ld but is instead %ld!\n", tid, p->owner);
+      w->next = p->free_waiters;
+      p->free_waiters = w;
       release(p);
    } else {
-      p->owner = VG_(gettid)();
-      // VG_(emit)("Thread#%lu: Obtained uncontested (holdout=Thread#%lu,num_holdout=%lu,used_thread_locks=%lu)\n", VG_(gettid)(), p->holdout_thread, p->num_holdout, p->used_thread_locks);
+      p->owner = tid;
       release(p);
-      return;
    }
 }
 
 static void exit_sched_lock(struct sched_lock *p) {
    acquire(p);
-   // VG_(emit)("Thread#%lu is exiting...\n", VG_(gettid)());
    if (VG_(count_living_threads)() == 2) {
       p->holdout_thread = VG_INVALID_THREADID;
+      p->holdout_waiter = NULL;
    }
    release(p);
    release_sched_lock(p);
@@ -43,6 +43,7 @@ static struct sched_lock_ops const *const sched_lock_impl[] = {
 #ifdef ENABLE_LINUX_TICKET_LOCK
    [sched_lock_ticket]  = &ML_(linux_ticket_lock_ops),
    [sched_random_lock] = &ML_(random_lock_ops),
+   [sched_pct_lock] = &ML_(pct_lock_ops),
 #endif
 };
 
@@ -100,3 +101,10 @@ void ML_(exit_sched_lock)(struct sched_lock *p)
 {
    return (sched_lock_ops->exit_sched_lock)(p);
 }
+
+Bool ML_(should_yield_sched_lock)(struct sched_lock *p, ULong bbs_done)
+{
+   if (!sched_lock_ops->should_yield)
+      return True;
+   return (sched_lock_ops->should_yield)(p, bbs_done);
+}
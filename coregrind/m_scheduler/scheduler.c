@@ -110,8 +110,6 @@ Bool VG_(in_generated_code) = False;
 Bool VG_(randomize_quantum) = False;
 /* Randomized Seed for quantum. */
 UInt VG_(quantum_seed) = 0;
-/* If we are inside of code of interest as specified via a hint. */
-Bool VG_(code_of_interest)[1024] = {False};
 /* If we handle code of interest hints.*/
 Bool VG_(handle_code_of_interest) = False; 
 
@@ -634,6 +632,9 @@ void mostly_clear_thread_record ( ThreadId tid )
    VG_(clear_out_queued_signals)(tid, &savedmask);
 
    VG_(threads)[tid].sched_jmpbuf_valid = False;
+
+   VG_(threads)[tid].code_of_interest = False;
+   VG_(threads)[tid].tool_data = NULL;
 }
 
 /*                                                                             
@@ -705,6 +706,10 @@ ThreadId VG_(scheduler_init_phase1) ( void )
       ML_(set_sched_lock_impl)(sched_random_lock);
    }
 
+   if (VG_(clo_fair_sched) == pct_sched) {
+      ML_(set_sched_lock_impl)(sched_pct_lock);
+   }
+
    if (VG_(clo_verbosity) > 1) {
       VG_(message)(Vg_DebugMsg,
                    "Scheduler: using %s scheduler lock implementation.\n",
@@ -1384,9 +1389,6 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 
    dispatch_ctr = VG_(scheduling_quantum);
 
-   static UInt random_pool[1024];
-   static UInt random_pool_idx = 1024;
-
    while (!VG_(is_exiting)(tid)) {
 
       vg_assert(dispatch_ctr >= 0);
@@ -1409,12 +1411,14 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 	 /* 3 Aug 06: doing sys__nsleep works but crashes some apps.
             sys_yield also helps the problem, whilst not crashing apps. */
 
-	 VG_(release_BigLock)(tid, VgTs_Yielding, 
-                                   "VG_(scheduler):timeslice");
-	 /* ------------ now we don't have The Lock ------------ */
+	 if (ML_(should_yield_sched_lock)(the_BigLock, bbs_done)) {
+	    VG_(release_BigLock)(tid, VgTs_Yielding, 
+                                      "VG_(scheduler):timeslice");
+	    /* ------------ now we don't have The Lock ------------ */
 
-	 VG_(acquire_BigLock)(tid, "VG_(scheduler):timeslice");
-	 /* ------------ now we do have The Lock ------------ */
+	    VG_(acquire_BigLock)(tid, "VG_(scheduler):timeslice");
+	    /* ------------ now we do have The Lock ------------ */
+	 }
 
 	 /* OK, do some relatively expensive housekeeping stuff */
 	 scheduler_sanity(tid);
@@ -1437,14 +1441,7 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 
 	 /* Figure out how many bbs to ask vg_run_innerloop to do. */
     if (VG_(randomize_quantum)) {
-      if (random_pool_idx == 1024) {
-         int fd = VG_(fd_open)("/dev/urandom", VKI_O_RDONLY, 0);
-         tl_assert2(fd >= 0, "Could not open /dev/urandom");
-         VG_(read)(fd, &random_pool, sizeof(random_pool));
-         VG_(close)(fd);
-         random_pool_idx = 0;
-      }
-      dispatch_ctr = (random_pool[random_pool_idx++] % VG_(scheduling_quantum)) + 1;
+      dispatch_ctr = (VG_(random)(&VG_(quantum_seed)) % VG_(scheduling_quantum)) + 1;
     } else {
       dispatch_ctr = VG_(scheduling_quantum);
     }
@@ -1581,19 +1578,11 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
       case VG_TRC_INNER_COUNTERZERO:
 	 /* Timeslice is out.  Let a new thread be scheduled. */
 	 vg_assert(dispatch_ctr == 0);
-      if (VG_(handle_code_of_interest) && random_pool_idx == 1024) {
-         int fd = VG_(fd_open)("/dev/urandom", VKI_O_RDONLY, 0);
-         tl_assert2(fd >= 0, "Could not open /dev/urandom");
-         VG_(read)(fd, &random_pool, sizeof(random_pool));
-         VG_(close)(fd);
-         random_pool_idx = 0;
-      }
       // Check if we are in code of interest
-      tl_assert2(VG_(get_running_tid)() < 1024, "More than 1024 threads! tid=%d", VG_(get_running_tid)());
       tl_assert(VG_(get_running_tid)() != VG_INVALID_THREADID && VG_(get_running_tid)() >= 0);
-      if (VG_(handle_code_of_interest) && !VG_(code_of_interest)[VG_(get_running_tid)()] && random_pool[random_pool_idx++] % 2 == 0) {
+      if (VG_(handle_code_of_interest) && !VG_(threads)[tid].code_of_interest && VG_(random)(&VG_(quantum_seed)) % 2 == 0) {
          if (VG_(randomize_quantum)) {
-            dispatch_ctr = (random_pool[random_pool_idx++] % VG_(scheduling_quantum)) + 1;
+            dispatch_ctr = (VG_(random)(&VG_(quantum_seed)) % VG_(scheduling_quantum)) + 1;
          } else {
             dispatch_ctr = VG_(scheduling_quantum);
          }
@@ -119,6 +119,24 @@ ThreadId VG_(get_running_tid)(void)
    return VG_(running_tid);
 }
 
+void* VG_(get_tool_thread_data)(ThreadId tid)
+{
+   vg_assert(tid >= 0 && tid < VG_N_THREADS);
+   return VG_(threads)[tid].tool_data;
+}
+
+void VG_(set_tool_thread_data)(ThreadId tid, void* data)
+{
+   vg_assert(tid >= 0 && tid < VG_N_THREADS);
+   VG_(threads)[tid].tool_data = data;
+}
+
+void VG_(set_code_of_interest)(ThreadId tid, Bool b)
+{
+   vg_assert(VG_(is_valid_tid)(tid));
+   VG_(threads)[tid].code_of_interest = b;
+}
+
 Bool VG_(is_running_thread)(ThreadId tid)
 {
    ThreadState *tst = VG_(get_ThreadState)(tid);
@@ -202,8 +202,15 @@ extern Bool  VG_(clo_debug_dump_frames);
 /* DEBUG: print redirection details?  default: NO */
 extern Bool  VG_(clo_trace_redir);
 /* Enable fair scheduling on multicore systems? default: NO */
-enum FairSchedType { disable_fair_sched, enable_fair_sched, try_fair_sched, random_sched };
+enum FairSchedType { disable_fair_sched, enable_fair_sched, try_fair_sched, random_sched, pct_sched };
 extern enum FairSchedType VG_(clo_fair_sched);
+/* Bug depth for --fair-sched=pct: the number of priority change points
+   plus one.  default: 3 */
+extern UInt  VG_(clo_pct_depth);
+/* Expected number of superblocks executed by the program; change points
+   for --fair-sched=pct are drawn uniformly from [1, VG_(clo_pct_sblocks)].
+   default: 1000000 */
+extern ULong VG_(clo_pct_sblocks);
 /* DEBUG: print thread scheduling events?  default: NO */
 extern Bool  VG_(clo_trace_sched);
 /* DEBUG: do heap profiling?  default: NO */
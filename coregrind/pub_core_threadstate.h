@@ -408,6 +408,15 @@ typedef struct {
    /* This thread's name. NULL, if no name. */
    HChar *thread_name;
    UInt ptrace;
+
+   /* Whether the thread is in code of interest to the scheduler; see
+      --handle-code-of-interest. Cleared when the thread exits. */
+   Bool code_of_interest;
+
+   /* Opaque per-thread pointer owned by the tool; NULL until the tool
+      sets it. The tool must release it in its pre_thread_ll_exit
+      tracker, as it is cleared when the thread exits. */
+   void *tool_data;
 }
 ThreadState;
 
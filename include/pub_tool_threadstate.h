@@ -44,6 +44,16 @@ extern UInt VG_N_THREADS;
 /* Get the TID of the thread which currently has the CPU. */
 extern ThreadId VG_(get_running_tid) ( void );
 
+/* Get/set the tool's per-thread pointer for 'tid'. It is NULL for a new
+   thread, and is cleared when the thread exits, so free it from the
+   pre_thread_ll_exit tracker. */
+extern void* VG_(get_tool_thread_data) ( ThreadId tid );
+extern void  VG_(set_tool_thread_data) ( ThreadId tid, void* data );
+
+/* Mark whether 'tid' is running code of interest to the scheduler
+   (see --handle-code-of-interest). */
+extern void VG_(set_code_of_interest) ( ThreadId tid, Bool b );
+
 #endif   // __PUB_TOOL_THREADSTATE_H
 
 /*--------------------------------------------------------------------*/
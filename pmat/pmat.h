@@ -45,13 +45,30 @@ typedef
        VG_USERREQ__PMC_PMAT_SCHEDULER_STOP, // TODO: Implement
        VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED,
        VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED_TOTAL,
+       VG_USERREQ__PMC_PMAT_THREAD_STATS,
    } Vg_pmatClientRequest;
 
+/* Counters of the current thread, filled in by PMAT_THREAD_STATS. */
+typedef struct {
+    unsigned long long superblocks;
+    /* Stores to registered memory, counted once per cache line written; adjacent stores
+       coalesced by --coalesce-stores=yes count as one */
+    unsigned long long stores;
+    unsigned long long flushes;
+    unsigned long long fences;
+} pmat_thread_stats;
+
 
 /*
-    Expected type for verification callbacks. These callbacks, if they exist, _should_
-    not make any system calls (so no stderr or stdout) and should be non-blocking; this
-    is called inside of a fork.
+    Expected type for verification callbacks, called with --in-process-verification=yes.
+    They are called inside of a fork of the crashing process and run natively, outside
+    of Valgrind, so:
+      - Only the thread that crashed exists; locks other threads held at the crash
+        (e.g. inside malloc or stdio) stay held, as after fork(2).
+      - On amd64, TLS is that of the crashing thread, so -fstack-protector and errno
+        work; on other architectures, anything touching TLS faults.
+      - They run on a small stack and must return, rather than exit, longjmp or
+        create threads. Their output goes to the files kept for a failed crash.
 */
 typedef int (*pmat_verify_fn)(void *buf, unsigned long long size);
 
@@ -114,10 +131,10 @@ typedef int (*pmat_verify_fn)(void *buf, unsigned long long size);
     VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__PMC_PMAT_TRANSIENT, \
             (_qzz_addr), (_qzz_sz), 0, 0, 0)
 
-/** Determine if the entire address range[addr, addr+sz) has been written-back; writes result into _qzz_ret */
-#define PMAT_IS_PERSIST(_qzz_addr, _qzz_sz, _qzz_ret) \
-    VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__PMC_PMAT_IS_PERSIST, \
-            (_qzz_addr), (_qzz_sz), (_qzz_ret), 0, 0)
+/** Determine if the entire address range [addr, addr+sz) has been written-back; 1 if so (or not under PMAT), else 0 */
+#define PMAT_IS_PERSIST(_qzz_addr, _qzz_sz) \
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(1, VG_USERREQ__PMC_PMAT_IS_PERSIST, \
+            (_qzz_addr), (_qzz_sz), 0, 0, 0)
 
 /** Add constraint for persist ordering such that[addr1, addr1 + sz1)must persist no later than[addr2, addr2 + sz2). */
 #define PMAT_PERSIST_ORDER(_qzz_addr1, _qzz_sz1, _qzz_addr2, _qzz_sz2) \
@@ -139,4 +156,9 @@ typedef int (*pmat_verify_fn)(void *buf, unsigned long long size);
 #define PMAT_SUPERBLOCKS_EXECUTED_TOTAL \
     VALGRIND_DO_CLIENT_REQUEST_EXPR(0, VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED_TOTAL, 0, 0, 0, 0, 0)
 
+/**  Fills the pmat_thread_stats at _qzz_stats with the current thread's counters;
+     returns 0, or -1 if _qzz_stats is NULL or the program is not run under PMAT. */
+#define PMAT_THREAD_STATS(_qzz_stats) \
+    ((int) VALGRIND_DO_CLIENT_REQUEST_EXPR(-1, VG_USERREQ__PMC_PMAT_THREAD_STATS, (_qzz_stats), 0, 0, 0, 0))
+
 #endif 
\ No newline at end of file
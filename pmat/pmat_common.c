@@ -19,23 +19,143 @@
 #include "pub_tool_libcassert.h"
 #include "pub_tool_vki.h"
 #include "pub_tool_libcfile.h"
+#include "pub_tool_libcbase.h"
+#include "pub_tool_libcprint.h"
 #include "pmat_include.h"
 
-#define PMAT_RANDOM_POOL_SIZE 8192
-static UInt random_pool[PMAT_RANDOM_POOL_SIZE];
-static UInt random_pool_idx = PMAT_RANDOM_POOL_SIZE;
-
 UInt get_urandom(void) {
-    if (random_pool_idx == PMAT_RANDOM_POOL_SIZE) {
-        int fd = VG_(fd_open)("/dev/urandom", VKI_O_RDONLY, 0);
-        tl_assert2(fd >= 0, "Could not open /dev/urandom");
-        VG_(read)(fd, &random_pool, sizeof(random_pool));
-        VG_(close)(fd);
-        random_pool_idx = 0;
+    UInt ret;
+    int fd = VG_(fd_open)("/dev/urandom", VKI_O_RDONLY, 0);
+    tl_assert2(fd >= 0, "Could not open /dev/urandom");
+    VG_(read)(fd, &ret, sizeof(ret));
+    VG_(close)(fd);
+    return ret;
+}
+
+struct pmat_rng pmat_rng_streams[PMAT_RNG_NUM_STREAMS];
+
+// SplitMix64, used to expand a seed into generator state
+static ULong splitmix64(ULong *x) {
+    ULong z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void pmat_rng_init(ULong seed) {
+    for (Int i = 0; i < PMAT_RNG_NUM_STREAMS; i++) {
+        // Streams are decorrelated by mixing their index into the seed
+        ULong x = seed ^ ((ULong) (i + 1) << 32);
+        for (Int j = 0; j < 4; j++) {
+            pmat_rng_streams[i].s[j] = splitmix64(&x);
+        }
+    }
+}
+
+
+// Slabs are capped so that memory grows with use rather than all up-front
+#define PMAT_ARENA_MAX_SLAB 65536
+static struct pmat_arena *pmat_arenas = NULL;
+
+struct pmat_arena *pmat_arena_create(const HChar *name, SizeT elemSize, SizeT capacity) {
+    struct pmat_arena *arena = VG_(malloc)(name, sizeof(struct pmat_arena));
+    arena->name = name;
+    // Keep elements word-aligned, and large enough to hold the free-list link
+    arena->elemSize = VG_ROUNDUP(VG_MAX(elemSize, sizeof(void *)), sizeof(void *));
+    arena->nPerSlab = VG_MAX(1, VG_MIN(capacity, PMAT_ARENA_MAX_SLAB));
+    arena->freeList = NULL;
+    arena->bump = NULL;
+    arena->bumpLeft = 0;
+    arena->nSlabs = 0;
+    arena->nAllocs = 0;
+    arena->nFrees = 0;
+    arena->nInUse = 0;
+    arena->nPeak = 0;
+    arena->next = pmat_arenas;
+    pmat_arenas = arena;
+    return arena;
+}
+
+void *pmat_arena_alloc(struct pmat_arena *arena) {
+    void *elem;
+    if (arena->freeList) {
+        elem = arena->freeList;
+        arena->freeList = *(void **) elem;
+    } else {
+        if (arena->bumpLeft == 0) {
+            arena->bump = VG_(malloc)(arena->name, arena->elemSize * arena->nPerSlab);
+            arena->bumpLeft = arena->nPerSlab;
+            arena->nSlabs++;
+        }
+        elem = arena->bump;
+        arena->bump += arena->elemSize;
+        arena->bumpLeft--;
+    }
+    arena->nAllocs++;
+    arena->nInUse++;
+    arena->nPeak = VG_MAX(arena->nPeak, arena->nInUse);
+    return elem;
+}
+
+void pmat_arena_free(struct pmat_arena *arena, void *elem) {
+    tl_assert2(arena->nInUse > 0, "Freeing into arena '%s' that has no live elements!", arena->name);
+    *(void **) elem = arena->freeList;
+    arena->freeList = elem;
+    arena->nFrees++;
+    arena->nInUse--;
+}
+
+void pmat_arena_print_stats(void) {
+    for (struct pmat_arena *arena = pmat_arenas; arena != NULL; arena = arena->next) {
+        VG_(umsg)("Arena '%s': %llu allocs, %llu frees, %llu in use, %llu peak, %llu slab(s) of %lu x %lu bytes\n",
+            arena->name, arena->nAllocs, arena->nFrees, arena->nInUse, arena->nPeak,
+            arena->nSlabs, arena->nPerSlab, arena->elemSize);
+    }
+}
+
+static struct pmat_shadow_secondary pmat_shadow_distinguished;
+struct pmat_shadow_secondary *pmat_shadow_primary[PMAT_SHADOW_PM_SIZE];
+
+void pmat_shadow_init(void) {
+    for (ULong i = 0; i < PMAT_SHADOW_PM_SIZE; i++) {
+        pmat_shadow_primary[i] = &pmat_shadow_distinguished;
+    }
+}
+
+static void pmat_shadow_set_page(Addr page, UChar state) {
+    tl_assert2((page >> PMAT_SHADOW_ADDR_BITS) == 0, "Address 0x%lx is outside of shadow map!", page);
+    struct pmat_shadow_secondary **sm = &pmat_shadow_primary[page >> PMAT_SHADOW_SM_BITS];
+    if (*sm == &pmat_shadow_distinguished) {
+        if (state == PMAT_SHADOW_NONE) return;
+        *sm = VG_(calloc)("pmat.shadow.secondary", 1, sizeof(struct pmat_shadow_secondary));
+    }
+    (*sm)->pages[(page >> PMAT_SHADOW_PAGE_BITS) & (PMAT_SHADOW_SM_SIZE - 1)] = state;
+}
+
+void pmat_shadow_set_range(Addr addr, SizeT size, UChar state) {
+    if (size == 0) return;
+    const Addr pageSize = 1ULL << PMAT_SHADOW_PAGE_BITS;
+    Addr end = addr + size;
+    for (Addr page = addr & ~(pageSize - 1); page < end; page += pageSize) {
+        // Partially covered pages may be shared with a neighbouring region
+        if (page < addr || page + pageSize > end) {
+            pmat_shadow_set_page(page, PMAT_SHADOW_CHECK);
+        } else {
+            pmat_shadow_set_page(page, state);
+        }
     }
-    return random_pool[random_pool_idx++];
 }
 
+void pmat_shadow_mark_check(Addr addr, SizeT size) {
+    if (size == 0) return;
+    const Addr pageSize = 1ULL << PMAT_SHADOW_PAGE_BITS;
+    Addr end = addr + size;
+    for (Addr page = addr & ~(pageSize - 1); page < end; page += pageSize) {
+        if (pmat_shadow_get(page) != PMAT_SHADOW_NONE) {
+            pmat_shadow_set_page(page, PMAT_SHADOW_CHECK);
+        }
+    }
+}
 
 Word cmp_pmat_write_buffer_entries(const void *key, const void *elem) {
     const struct pmat_writeback_buffer_entry *lhs = (const struct pmat_writeback_buffer_entry *) (key);
@@ -78,9 +198,9 @@ Word cmp_pmat_cache_entries(const void *key, const void *elem) {
     return lhs->addr - rhs->addr;
 }
 
-static struct pmat_lru_node* create_lru_node(Addr key, void *value) 
+static struct pmat_lru_node* create_lru_node(struct pmat_arena *arena, Addr key, void *value) 
 { 
-    struct pmat_lru_node* node = VG_(malloc)("lru.node", sizeof(struct pmat_lru_node)); 
+    struct pmat_lru_node* node = pmat_arena_alloc(arena); 
     node->key = key; 
     node->value = value;
     node->left = NULL;
@@ -183,16 +303,17 @@ struct pmat_lru_node *splay(struct pmat_lru_node *root, Addr key)
 } 
 
 // Create LRU cache utilizing a comparator
-struct pmat_lru_cache *pmat_create_lru(void) {
+struct pmat_lru_cache *pmat_create_lru(SizeT capacity) {
     struct pmat_lru_cache *cache = VG_(malloc)("lru.cache", (SizeT)sizeof(struct pmat_lru_cache));
     cache->root = NULL;
-    cache->seed = get_urandom();
+    cache->arena = pmat_arena_create("lru.node", sizeof(struct pmat_lru_node), capacity);
+    cache->seed = pmat_random(PMAT_RNG_EVICTION);
     return cache;
 }
 
 // Insert key and value into LRU Cache.
 void pmat_lru_cache_insert(struct pmat_lru_cache *cache, Addr key, void *value) {
-    struct pmat_lru_node *node = create_lru_node(key, value);
+    struct pmat_lru_node *node = create_lru_node(cache->arena, key, value);
     if (cache->root == NULL) {
         cache->root = node;
         return;
@@ -234,7 +355,7 @@ void *pmat_lru_cache_evict(struct pmat_lru_cache *cache) {
             break;
         }
         parent = node;
-        UInt x = get_urandom() % 100;
+        UInt x = pmat_random(PMAT_RNG_EVICTION) % 100;
         UInt total = node->num_left + node->num_right;
         UInt probLeft = (node->num_left / ((Double) total)) * 100;
         if (x <= probLeft) {
@@ -253,9 +374,12 @@ void *pmat_lru_cache_evict(struct pmat_lru_cache *cache) {
         } else {
             tl_assert2(0, "Somehow parent->left nor parent->right is equal to node!");
         }
+    } else {
+        // Evicting the last node; the root must not dangle into the arena
+        cache->root = NULL;
     }
     void *retval = node->value;
-    VG_(free)(node->value);
+    pmat_arena_free(cache->arena, node);
     return retval;
 }
 
@@ -284,6 +408,15 @@ void *pmat_lru_cache_lookup(struct pmat_lru_cache *cache, Addr key) {
     return retval;
 }
 
+// Searches the LRU cache without splaying, so that queries leave the order of eviction alone
+void *pmat_lru_cache_peek(struct pmat_lru_cache *cache, Addr key) {
+    struct pmat_lru_node *node = cache->root;
+    while (node != NULL && node->key != key) {
+        node = (node->key > key) ? node->left : node->right;
+    }
+    return node ? node->value : NULL;
+}
+
 // Obtains the size of the LRU Cache
 Int pmat_lru_cache_size(struct pmat_lru_cache *cache) {
     return (cache->root) ? (cache->root->num_left + cache->root->num_right + 1) : 0;
@@ -299,10 +432,11 @@ void **pmat_lru_cache_to_array(struct pmat_lru_cache *cache, SizeT *sz) {
 
 
 // Create LRU cache utilizing a comparator
-struct pmat_rr_cache *pmat_create_rr(void) {
+struct pmat_rr_cache *pmat_create_rr(SizeT capacity) {
     struct pmat_rr_cache *cache = VG_(malloc)("pmat.pmat_rr_cache", sizeof(struct pmat_rr_cache));
     cache->htable = VG_(HT_construct)("pmat.pmat_rr_cache.htable");
-    cache->seed = get_urandom();
+    cache->arena = pmat_arena_create("htable.entry", sizeof(struct pmat_htable_entry), capacity);
+    cache->seed = pmat_random(PMAT_RNG_EVICTION);
     cache->size = 0;
     return cache;
 }
@@ -310,7 +444,7 @@ struct pmat_rr_cache *pmat_create_rr(void) {
 // Insert key and value into RR Cache.
 void pmat_rr_cache_insert(struct pmat_rr_cache *cache, Addr key, void *value) {
     tl_assert2(VG_(HT_lookup)(cache->htable, key) == NULL, "Found existing cache-line for %lu!\n", key);
-    struct pmat_htable_entry *entry = VG_(malloc)("htable.entry", sizeof(struct pmat_htable_entry));
+    struct pmat_htable_entry *entry = pmat_arena_alloc(cache->arena);
     entry->next = NULL;
     entry->key = key;
     entry->value = value;
@@ -324,7 +458,7 @@ void *pmat_rr_cache_evict(struct pmat_rr_cache *cache) {
     struct PMAT_VgHashTable *htable = cache->htable;
     struct pmat_htable_entry **entries = htable->chains;
     // Take a random index
-    UInt idx = get_urandom() % htable->n_chains;
+    UInt idx = pmat_random(PMAT_RNG_EVICTION) % htable->n_chains;
     UInt loops = 0;
     while (htable->chains[idx] == NULL) {
         tl_assert2(loops != htable->n_chains, "Infinite Loop over VGHashTable Chains!");
@@ -336,14 +470,14 @@ void *pmat_rr_cache_evict(struct pmat_rr_cache *cache) {
         chainSize += 1;
     }
     tl_assert2(chainSize >= 1, "Somehow have a chainSize of %lu\n", chainSize);
-    UInt chainIdx = (chainSize > 1) ? (get_urandom() % chainSize) : 0;
+    UInt chainIdx = (chainSize > 1) ? (pmat_random(PMAT_RNG_EVICTION) % chainSize) : 0;
     for (struct pmat_htable_entry *entry = htable->chains[idx]; entry != NULL; entry = entry->next) {
         if (chainIdx == 0) {
             // Found it...
             entry = VG_(HT_remove)(cache->htable, entry->key);
             tl_assert2(entry != NULL, "Somehow cannot remove current entry!");
             void *retval = entry->value;
-            VG_(free)(entry);
+            pmat_arena_free(cache->arena, entry);
             return retval;   
         }
         chainIdx--;
@@ -367,7 +501,7 @@ void *pmat_rr_cache_remove(struct pmat_rr_cache *cache, Addr key) {
         return NULL;
     }
     void *retval = entry->value;
-    VG_(free)(entry);
+    pmat_arena_free(cache->arena, entry);
     cache->size--;
     return retval;
 }
@@ -387,3 +521,125 @@ void **pmat_rr_cache_to_array(struct pmat_rr_cache *cache, SizeT *sz) {
     *sz = size;
     return retval;
 }
+
+static inline SizeT flat_cache_home(struct pmat_flat_cache *cache, Addr key) {
+    return ((key / CACHELINE_SIZE) * 0x9E3779B97F4A7C15ULL) >> cache->shift;
+}
+
+// Returns index of the slot holding key, or of the empty slot that ends its probe sequence
+static inline SizeT flat_cache_probe(struct pmat_flat_cache *cache, Addr key) {
+    SizeT i = flat_cache_home(cache, key);
+    while (cache->slots[i].key != 0 && cache->slots[i].key != key) {
+        i = (i + 1) & cache->mask;
+    }
+    return i;
+}
+
+static void flat_cache_alloc(struct pmat_flat_cache *cache, SizeT capacity) {
+    SizeT nSlots = 16;
+    UInt bits = 4;
+    while (nSlots < 2 * capacity) {
+        nSlots *= 2;
+        bits++;
+    }
+    cache->slots = VG_(calloc)("pmat.pmat_flat_cache.slots", nSlots, sizeof(struct pmat_flat_slot));
+    cache->entries = VG_(malloc)("pmat.pmat_flat_cache.entries", capacity * sizeof(struct pmat_flat_entry));
+    cache->shift = 64 - bits;
+    cache->mask = nSlots - 1;
+    cache->capacity = capacity;
+}
+
+// Double the capacity of the cache and re-insert all entries
+static void flat_cache_grow(struct pmat_flat_cache *cache) {
+    struct pmat_flat_entry *oldEntries = cache->entries;
+    SizeT oldSize = cache->size;
+    VG_(free)(cache->slots);
+    flat_cache_alloc(cache, cache->capacity * 2);
+    cache->size = 0;
+    for (SizeT i = 0; i < oldSize; i++) {
+        pmat_flat_cache_insert(cache, oldEntries[i].key, oldEntries[i].value);
+    }
+    VG_(free)(oldEntries);
+}
+
+struct pmat_flat_cache *pmat_create_flat(SizeT capacity) {
+    struct pmat_flat_cache *cache = VG_(malloc)("pmat.pmat_flat_cache", sizeof(struct pmat_flat_cache));
+    flat_cache_alloc(cache, VG_MAX(capacity, 1));
+    cache->size = 0;
+    return cache;
+}
+
+void pmat_flat_cache_insert(struct pmat_flat_cache *cache, Addr key, void *value) {
+    tl_assert2(key != 0, "Cannot insert cache-line for address 0!");
+    if (cache->size == cache->capacity) {
+        flat_cache_grow(cache);
+    }
+    SizeT i = flat_cache_probe(cache, key);
+    tl_assert2(cache->slots[i].key == 0, "Found existing cache-line for %lu!\n", key);
+    cache->slots[i].key = key;
+    cache->slots[i].idx = cache->size;
+    cache->entries[cache->size].key = key;
+    cache->entries[cache->size].value = value;
+    cache->size++;
+}
+
+void *pmat_flat_cache_lookup(struct pmat_flat_cache *cache, Addr key) {
+    SizeT i = flat_cache_probe(cache, key);
+    if (cache->slots[i].key == 0) {
+        return NULL;
+    }
+    return cache->entries[cache->slots[i].idx].value;
+}
+
+void *pmat_flat_cache_remove(struct pmat_flat_cache *cache, Addr key) {
+    SizeT i = flat_cache_probe(cache, key);
+    if (cache->slots[i].key == 0) {
+        return NULL;
+    }
+    UInt idx = cache->slots[i].idx;
+    void *retval = cache->entries[idx].value;
+
+    // Keep the dense array packed by moving the last entry into the hole
+    SizeT last = cache->size - 1;
+    if (idx != last) {
+        cache->entries[idx] = cache->entries[last];
+        cache->slots[flat_cache_probe(cache, cache->entries[idx].key)].idx = idx;
+    }
+    cache->size--;
+
+    // Backward-shift deletion; keeps probe sequences intact without tombstones
+    SizeT j = i;
+    while (True) {
+        j = (j + 1) & cache->mask;
+        if (cache->slots[j].key == 0) {
+            break;
+        }
+        SizeT home = flat_cache_home(cache, cache->slots[j].key);
+        Bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            cache->slots[i] = cache->slots[j];
+            i = j;
+        }
+    }
+    cache->slots[i].key = 0;
+    return retval;
+}
+
+void *pmat_flat_cache_evict(struct pmat_flat_cache *cache) {
+    tl_assert2(cache->size > 0, "Attempt to evict from a cache that is empty!");
+    SizeT idx = pmat_random(PMAT_RNG_EVICTION) % cache->size;
+    return pmat_flat_cache_remove(cache, cache->entries[idx].key);
+}
+
+SizeT pmat_flat_cache_size(struct pmat_flat_cache *cache) {
+    return cache->size;
+}
+
+void **pmat_flat_cache_to_array(struct pmat_flat_cache *cache, SizeT *sz) {
+    void **retval = VG_(malloc)("pmat.pmat_flat_cache.to_array", sizeof(void *) * VG_MAX(cache->size, 1));
+    for (SizeT i = 0; i < cache->size; i++) {
+        retval[i] = cache->entries[i].value;
+    }
+    *sz = cache->size;
+    return retval;
+}
@@ -15,23 +15,31 @@ struct pmat_cache_entry {
     ThreadId tid; // id of last thread to store
     ULong dirtyBits;
     Addr addr;
+    struct pmat_registered_file *file; // file containing the cache line
     UChar data[0];
 };
 
 
 struct pmat_registered_file {
     char *name;
+    char *path; // path of the shadow heap, as given to the verifier
     UWord descr;
     Addr addr; 
     UWord size;
     Addr mmap_addr;
     pmat_verify_fn verify_fn;
+    ULong hash; // hash of the shadow heap; see --dedup-verifications
+    UChar *materialized; // bitmap of pages copied into the shadow heap; NULL if copied at registration
+    UShort *pending; // per cache line, copies in the cache, write-back or write-combining buffers
 };
 
 struct pmat_writeback_buffer_entry {
     struct pmat_cache_entry *entry;
     ExeContext *locOfFlush;
     ThreadId tid; 
+    // Links in the per-thread queue of the flushing thread
+    struct pmat_writeback_buffer_entry *prev;
+    struct pmat_writeback_buffer_entry *next;
 };
 
 // Converts addr to cache line addr
@@ -40,6 +48,9 @@ struct pmat_writeback_buffer_entry {
 #define OFFSET_CACHELINE(addr) ((addr) % CACHELINE_SIZE)
 #define NUM_CACHE_ENTRIES 1024ULL
 #define NUM_WB_ENTRIES 64ULL
+// Per-thread write-combining buffers for non-temporal stores, as many as the
+// line fill buffers of recent x86 cores
+#define NUM_WC_ENTRIES 10U
 
 /*
     sys/waitstatus.h constants for portability (only on Linux, of course...)
@@ -83,6 +94,83 @@ Word cmp_pmat_write_buffer_entries(const void *key, const void *elem);
 
 Word cmp_pmat_transient_entries(const void *key, const void *elem);
 
+/**
+ * Fixed-size free-list arena. Elements are bump-allocated out of slabs sized
+ * from the expected capacity, and freed elements are kept on a free-list for
+ * reuse rather than being returned to the general allocator.
+ */
+struct pmat_arena {
+    const HChar *name;
+    SizeT elemSize;
+    SizeT nPerSlab;
+    // Singly-linked through the first word of each free element
+    void *freeList;
+    UChar *bump;
+    SizeT bumpLeft;
+    ULong nSlabs;
+    ULong nAllocs;
+    ULong nFrees;
+    ULong nInUse;
+    ULong nPeak;
+    // All arenas are chained together for statistics
+    struct pmat_arena *next;
+};
+
+// Create an arena for elements of 'elemSize' bytes, expecting at most 'capacity' live elements
+struct pmat_arena *pmat_arena_create(const HChar *name, SizeT elemSize, SizeT capacity);
+
+void *pmat_arena_alloc(struct pmat_arena *arena);
+
+void pmat_arena_free(struct pmat_arena *arena, void *elem);
+
+// Print allocation statistics of every arena
+void pmat_arena_print_stats(void);
+
+/**
+ * Shadow map of the address space, modeled after memcheck's primary and
+ * secondary maps. Each 4KB page has one byte of state describing whether a
+ * store to it may hit a registered persistent region. Primary entries that
+ * do not cover any registered memory point to a shared all-zero secondary
+ * map, so lookups never need a NULL check.
+ */
+#define PMAT_SHADOW_PAGE_BITS 12ULL
+#define PMAT_SHADOW_SM_BITS 30ULL
+#define PMAT_SHADOW_ADDR_BITS 48ULL
+#define PMAT_SHADOW_PM_SIZE (1ULL << (PMAT_SHADOW_ADDR_BITS - PMAT_SHADOW_SM_BITS))
+#define PMAT_SHADOW_SM_SIZE (1ULL << (PMAT_SHADOW_SM_BITS - PMAT_SHADOW_PAGE_BITS))
+
+// Page does not overlap any registered region.
+#define PMAT_SHADOW_NONE 0
+// Page lies entirely inside of a registered region and has no transient ranges.
+#define PMAT_SHADOW_PMEM 1
+// Page is partially registered or overlaps a transient range; take the slow path.
+#define PMAT_SHADOW_CHECK 2
+// Like PMEM, but the page has not been copied into the shadow heap yet (--lazy-shadow).
+#define PMAT_SHADOW_LAZY 3
+
+struct pmat_shadow_secondary {
+    UChar pages[PMAT_SHADOW_SM_SIZE];
+};
+
+extern struct pmat_shadow_secondary *pmat_shadow_primary[PMAT_SHADOW_PM_SIZE];
+
+// Point every primary entry at the distinguished (empty) secondary map.
+void pmat_shadow_init(void);
+
+// Set state of pages fully inside of [addr, addr + size); partially covered pages become CHECK.
+void pmat_shadow_set_range(Addr addr, SizeT size, UChar state);
+
+// Demote registered pages overlapping [addr, addr + size) to CHECK.
+void pmat_shadow_mark_check(Addr addr, SizeT size);
+
+static inline UChar pmat_shadow_get(Addr addr) {
+    if (UNLIKELY(addr >> PMAT_SHADOW_ADDR_BITS)) {
+        return PMAT_SHADOW_CHECK;
+    }
+    return pmat_shadow_primary[addr >> PMAT_SHADOW_SM_BITS]
+        ->pages[(addr >> PMAT_SHADOW_PAGE_BITS) & (PMAT_SHADOW_SM_SIZE - 1)];
+}
+
 /**
  * Eviction Policy Callbacks; All new policies should implement this interface.
  * This will make it easier to extend the cache policy for later.
@@ -96,6 +184,8 @@ struct pmat_eviction_policy {
     void *(*remove)(void *, Addr);
     // Callback to find a specific entry in the cache
     void *(*lookup)(void *, Addr);
+    // Callback to find a specific entry without counting it as a use of it
+    void *(*peek)(void *, Addr);
     // Callback to find the number of entries in the cache
     SizeT (*size)(void *);
     // Callback to convert the cache to an array.
@@ -121,13 +211,58 @@ struct pmat_lru_node {
 
 struct pmat_lru_cache {
     struct pmat_lru_node *root;
+    struct pmat_arena *arena;
     UInt seed;
 };
 
+// Reads a random number from /dev/urandom; only used to pick a default seed
 UInt get_urandom(void);
 
+/**
+ * Seeded xoshiro256** generator. Each source of randomness draws from its own
+ * stream so that, for a given --rng-seed, e.g. extra evictions do not change
+ * where crashes are simulated.
+ */
+struct pmat_rng {
+    ULong s[4];
+};
+
+enum pmat_rng_stream {
+    PMAT_RNG_EVICTION,
+    PMAT_RNG_CRASH,
+    PMAT_RNG_SCHEDULE,
+    PMAT_RNG_STACK,
+    PMAT_RNG_NUM_STREAMS
+};
+
+extern struct pmat_rng pmat_rng_streams[PMAT_RNG_NUM_STREAMS];
+
+// Seed every stream from a single seed
+void pmat_rng_init(ULong seed);
+
+static inline ULong pmat_rng_rotl(ULong x, Int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline ULong pmat_rng_next(struct pmat_rng *rng) {
+    ULong *s = rng->s;
+    ULong result = pmat_rng_rotl(s[1] * 5, 7) * 9;
+    ULong t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = pmat_rng_rotl(s[3], 45);
+    return result;
+}
+
+static inline UInt pmat_random(enum pmat_rng_stream stream) {
+    return pmat_rng_next(&pmat_rng_streams[stream]) >> 32;
+}
+
 // Create LRU cache utilizing a comparator
-struct pmat_lru_cache *pmat_create_lru();
+struct pmat_lru_cache *pmat_create_lru(SizeT capacity);
 
 // Insert key and value into LRU Cache.
 void pmat_lru_cache_insert(struct pmat_lru_cache *cache, Addr key, void *value);
@@ -141,6 +276,9 @@ void *pmat_lru_cache_evict(struct pmat_lru_cache *cache);
 // Searches the LRU cache; if present, returns value and splays; returns NULL if not found
 void *pmat_lru_cache_lookup(struct pmat_lru_cache *cache, Addr key);
 
+// Searches the LRU cache without splaying; returns value if present, else NULL
+void *pmat_lru_cache_peek(struct pmat_lru_cache *cache, Addr key);
+
 // Obtains the size of the LRU Cache
 Int pmat_lru_cache_size(struct pmat_lru_cache *cache);
 
@@ -153,6 +291,7 @@ void **pmat_lru_cache_to_array(struct pmat_lru_cache *cache, SizeT *sz);
  */
 struct pmat_rr_cache {
     VgHashTable *htable;
+    struct pmat_arena *arena;
     UInt seed;
     SizeT size;
 };
@@ -175,7 +314,7 @@ struct PMAT_VgHashTable {
 };
 
 // Create LRU cache utilizing a comparator
-struct pmat_rr_cache *pmat_create_rr(void);
+struct pmat_rr_cache *pmat_create_rr(SizeT capacity);
 
 // Insert key and value into RR Cache.
 void pmat_rr_cache_insert(struct pmat_rr_cache *cache, Addr key, void *value);
@@ -194,5 +333,49 @@ Int pmat_rr_cache_size(struct pmat_rr_cache *cache);
 
 void **pmat_rr_cache_to_array(struct pmat_rr_cache *cache, SizeT *sz);
 
+/**
+ * Flat Random-Replacement Cache; an open-addressed table (linear probing) that holds
+ * the cache-line address and entry inline in each slot, so inserting never allocates.
+ * A dense array of the live entries lets eviction pick a random victim in O(1).
+ */
+struct pmat_flat_slot {
+    Addr key; // 0 if the slot is empty
+    UInt idx; // Index into the dense array of entries
+};
+
+struct pmat_flat_entry {
+    Addr key;
+    void *value;
+};
+
+struct pmat_flat_cache {
+    struct pmat_flat_slot *slots;
+    UInt shift; // 64 - log2(number of slots)
+    SizeT mask;
+    struct pmat_flat_entry *entries;
+    SizeT size;
+    SizeT capacity;
+};
+
+// Create Flat cache able to hold 'capacity' entries before having to grow
+struct pmat_flat_cache *pmat_create_flat(SizeT capacity);
+
+// Insert key and value into Flat Cache.
+void pmat_flat_cache_insert(struct pmat_flat_cache *cache, Addr key, void *value);
+
+// Evicts a random entry from the Flat Cache; returns evicted value
+void *pmat_flat_cache_evict(struct pmat_flat_cache *cache);
+
+// Searches the Flat cache; returns value if present, else NULL
+void *pmat_flat_cache_lookup(struct pmat_flat_cache *cache, Addr key);
+
+// Removes a key from Flat Cache; will return value if found, else NULL
+void *pmat_flat_cache_remove(struct pmat_flat_cache *cache, Addr key);
+
+// Obtains the size of the Flat Cache
+SizeT pmat_flat_cache_size(struct pmat_flat_cache *cache);
+
+void **pmat_flat_cache_to_array(struct pmat_flat_cache *cache, SizeT *sz);
+
 
 #endif	/* PMAT_INCLUDE_H */
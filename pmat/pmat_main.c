@@ -34,10 +34,18 @@
 #include "pub_tool_machine.h"
 #include "pub_tool_stacktrace.h"
 #include "pub_tool_debuginfo.h"
+#include "pub_tool_transtab.h"
 #include "pmat.h"
 #include "pmat_include.h"
 #include "pub_core_scheduler.h"
+#include "pub_core_libcsignal.h"
+#include "pub_core_options.h"
+#include "pub_core_syscall.h"
+#include "pub_tool_vkiscnums.h"
 #include "pub_tool_vki.h"
+#if defined(VGA_amd64)
+#include "libvex_guest_amd64.h"
+#endif
 
 /* track at max this many multiple overwrites */
 #define MAX_MULT_OVERWRITES 10000UL
@@ -63,15 +71,60 @@
 /** Max allowable path length */
 #define MAX_PATH_SIZE 4096
 
+/** Exit status of a background verification whose verifier was killed for taking too long */
+#define PMAT_JOB_TIMED_OUT 2
+
+/** Deepest stack recorded for --store-stack-depth */
+#define PMAT_MAX_STACK_DEPTH 500
+
+/** How much of the stack to record for stores and flushes; see --store-stack-mode */
+enum pmat_stack_mode {
+    PMAT_STACK_FULL,
+    PMAT_STACK_IP,
+    PMAT_STACK_FIRST,
+    PMAT_STACK_SAMPLED
+};
+
+/** Identifies a --record-crashes file ("PMATREC1") */
+#define PMAT_RECORD_MAGIC 0x3143455254414D50ULL
+
+/**
+ * Header of a --record-crashes file; holds everything that decides where
+ * crashes happen and how threads are scheduled. It is followed by one
+ * pmat_crash_record per simulated crash.
+ */
+struct pmat_record_header {
+    ULong magic;
+    UInt rng_seed;
+    UInt randomize_quantum;
+    Long scheduling_quantum;
+};
+
+/** State at a simulated crash, used to detect a replay that has diverged. */
+struct pmat_crash_record {
+    ULong sblocks;
+    ULong rng_digest;
+};
+
 /** Holds parameters and runtime data */
 static struct pmem_ops {
     const HChar *pmat_eviction_policy_str;
+    const HChar *pmat_store_stack_mode_str;
+    enum pmat_stack_mode pmat_store_stack_mode;
+    /** Number of frames recorded; 0 uses --num-callers. */
+    Long pmat_store_stack_depth;
+    /** Probability that a store or flush records its full stack with --store-stack-mode=sampled */
+    Double pmat_store_stack_prob;
     /** Eviction policy being used. */
     struct pmat_eviction_policy pmat_eviction_policy;
     /** Mappings of files addresses to their descriptors */
     OSet *pmat_registered_files;
-    /** Store buffer for to-be-written-back stores. */
+    /** Store buffer for to-be-written-back stores; indexes the per-thread queues by cache-line. */
     OSet *pmat_writeback_buffer_entries;
+    /** Per-thread queues of write-back buffer entries, indexed by ThreadId. */
+    struct pmat_wb_queue *pmat_wb_queues;
+    /** Number of per-thread write-back queues allocated. */
+    UInt pmat_num_wb_queues;
     /** Aggregate dumps (null if pmat_aggregate_dump_only is false) (Cache-Only) */
     OSet *pmat_aggregate_cache_dump;
     OSet *pmat_aggregate_flushed_dump;
@@ -79,12 +132,18 @@ static struct pmem_ops {
     Bool pmat_should_verify;
     /** Verification program */
     const HChar *pmat_verifier;
+    /** Whether to call the verification callbacks of registered files in the forked child instead of exec'ing the verifier. */
+    Bool pmat_in_process_verification;
     /** Whether or not a copy of the shadow region (binary) should be preserved on error. */
     Bool pmat_preserve_bin_on_error;
     /** Whether to create a single aggregated .dump file or not on exit. No .stderr or .stdout files are created if so. */
     Bool pmat_aggregate_dump_only;
     /** Whether to terminate on the first error or not. */
     Bool pmat_terminate_on_error;
+    /** Whether stores are guarded by an inline check of the shadow map. */
+    Bool pmat_inline_pmem_check;
+    /** Arena for cache entries (shared by the simulated cache and write-back buffer). */
+    struct pmat_arena *pmat_cache_entry_arena;
     /** Set of addresses to ignore (marked transient) */
     OSet *pmat_transient_addresses; 
     /** Random Seed used for RNG. */
@@ -95,10 +154,6 @@ static struct pmem_ops {
     Double pmat_crash_prob;
     /** Lowest probability of crash occurring... defaults 0.5 * base probability */
     Double pmat_min_crash_prob;
-    /** RNG Pool filled by /dev/urandom, shared by all threads */
-    UInt pmat_rng_pool[8192];
-    /** RNG Pool filled */
-    UInt pmat_rng_pool_idx;
     /** Highest probability of crash occurring... defaults to 1.5 * base probability */
     /** Number of cache entries... Defaults to 1024 * 1024 (64MBs of Cache) */
     Word pmat_num_cache_entries;
@@ -106,8 +161,48 @@ static struct pmem_ops {
     Word pmat_num_wb_entries;
     /** Number of verifications that have been run so far. */
     Word num_verifications;
+    /** Number of verifications whose time has been recorded; lags behind while verifiers run in the background. */
+    Word num_timed_verifications;
+    /** Maximum number of verifiers run in the background at once; 1 verifies synchronously. */
+    Int pmat_verifier_jobs;
+    /** Verifiers running in the background, oldest first. */
+    struct pmat_verifier_job *pmat_running_jobs;
+    Int pmat_num_running_jobs;
     /** Number of bad verifications. */
     Word num_bad_verifications;
+    /** Number of bad verifications whose verifier was killed for exceeding the timeout. */
+    Word num_timed_out_verifications;
+    /** Milliseconds a verifier may run before being killed; 0 waits forever. */
+    Long pmat_verifier_timeout;
+    /** File that every simulated crash is recorded to (null if not recording). */
+    const HChar *pmat_record_file;
+    Int pmat_record_fd;
+    /** File recorded by an earlier run to replay (null if not replaying). */
+    const HChar *pmat_replay_file;
+    /** Simulated crash to stop at when replaying. */
+    Word pmat_replay_crash;
+    /** What the recorded run saw at the crash being replayed. */
+    struct pmat_crash_record pmat_replay_record;
+    /** Whether to skip verifying crash states that already passed verification. */
+    Bool pmat_dedup_verifications;
+    /** Hashes of crash states that passed verification. */
+    VgHashTable *pmat_verified_states;
+    /** Number of crashes skipped because their state already passed verification. */
+    Word num_deduplicated_verifications;
+    /** Whether shadow heaps are copied from the program a page at a time, before the first store to it. */
+    Bool pmat_lazy_shadow;
+    /** Directory shadow heaps and their copies are created in (null for the working directory). */
+    const HChar *pmat_shadow_dir;
+    /** Whether shadow heaps are anonymous memory files rather than files in pmat_shadow_dir. */
+    Bool pmat_shadow_memfd;
+    /** Whether adjacent stores of a superblock are traced with one helper call. */
+    Bool pmat_coalesce_stores;
+    /** Whether non-temporal stores bypass the cache through per-thread write-combining buffers. */
+    Bool pmat_non_temporal_stores;
+    /** Whether code is left uninstrumented while no region is registered. */
+    Bool pmat_lazy_instrumentation;
+    /** Whether translations made now are instrumented; only cleared with pmat_lazy_instrumentation. */
+    Bool pmat_instrumenting;
     /** Average nanoseconds per verification call*/
     Double average_verification_time;
     /** Minimum nanoseconds per verification call*/
@@ -120,6 +215,29 @@ static struct pmem_ops {
     Double ssd_verification_time;
 } pmem;
 
+/** Write-back buffer entries flushed, but not yet fenced, by a single thread. */
+struct pmat_wb_queue {
+    struct pmat_writeback_buffer_entry *head;
+    struct pmat_writeback_buffer_entry *tail;
+};
+
+/**
+ * Verification 'verif_num' running in the background; 'fd' is the read end
+ * of a pipe on which the job reports how long verification took.
+ */
+struct pmat_verifier_job {
+    Int pid;
+    Int verif_num;
+    Int fd;
+    ULong state;
+};
+
+/** Node of pmat_verified_states */
+struct pmat_verified_state {
+    struct pmat_verified_state *next;
+    UWord key;
+};
+
 struct pmat_flush_location {
     ExeContext *store;
     ExeContext *flush;
@@ -156,12 +274,70 @@ extern UInt VG_(scheduling_quantum);
 
 /** Number of sblock run. */
 static ULong sblocks = 0;
-static ULong threadSBlocks[1024] = {0};
 extern UChar VG_(clo_trace_flags);
 
-extern Bool VG_(code_of_interest)[1024];
 extern Bool VG_(handle_code_of_interest); 
 
+/** Per-thread counters, hung off the thread's tool-data slot. */
+struct pmat_thread_state {
+    ULong sblocks;
+    ULong stores;
+    ULong flushes;
+    ULong fences;
+    /** Lines written by non-temporal stores and not yet drained, oldest first. */
+    struct pmat_cache_entry *wc[NUM_WC_ENTRIES];
+    UInt num_wc;
+};
+
+/**
+ * Superblock counter of the thread running client code, incremented inline
+ * by every superblock; repointed whenever a thread starts running.
+ */
+static ULong unused_sblocks = 0;
+static ULong *current_sblocks = &unused_sblocks;
+
+/** The state of a thread, created the first time it is needed. */
+static struct pmat_thread_state *thread_state(ThreadId tid)
+{
+    struct pmat_thread_state *ts = VG_(get_tool_thread_data)(tid);
+    if (UNLIKELY(ts == NULL)) {
+        ts = VG_(calloc)("pmat.thread_state", 1, sizeof(struct pmat_thread_state));
+        VG_(set_tool_thread_data)(tid, ts);
+    }
+    return ts;
+}
+
+static struct pmat_thread_state *current_thread_state(void)
+{
+    return thread_state(VG_(get_running_tid)());
+}
+
+static void pmat_start_client_code(ThreadId tid, ULong bbs_done)
+{
+    current_sblocks = &thread_state(tid)->sblocks;
+}
+
+static void writeback_entry(struct pmat_cache_entry *entry, ThreadId tid, ExeContext *locOfFlush);
+
+/** Releases the state of an exiting thread so its ThreadId can be reused. */
+static void pmat_thread_exit(ThreadId tid)
+{
+    struct pmat_thread_state *ts = VG_(get_tool_thread_data)(tid);
+    if (ts) {
+        // Lines still being combined reach memory once the thread is gone
+        UInt num_wc = ts->num_wc;
+        ts->num_wc = 0;
+        for (UInt i = 0; i < num_wc; i++) {
+            writeback_entry(ts->wc[i], tid, NULL);
+        }
+        if (current_sblocks == &ts->sblocks) {
+            current_sblocks = &unused_sblocks;
+        }
+        VG_(free)(ts);
+        VG_(set_tool_thread_data)(tid, NULL);
+    }
+}
+
 static void stringify_stack_trace(ExeContext *context, int fd);
 static Int cmp_exe_context_pointers(const ExeContext **lhs, const ExeContext **rhs);
 static void maybe_simulate_crash(void);
@@ -188,6 +364,10 @@ static void *eviction_lookup(Addr key) {
     return pmem.pmat_eviction_policy.lookup(pmem.pmat_eviction_policy.arg, key);
 }
 
+static void *eviction_peek(Addr key) {
+    return pmem.pmat_eviction_policy.peek(pmem.pmat_eviction_policy.arg, key);
+}
+
 static void eviction_insert(Addr key, void *value) {
     pmem.pmat_eviction_policy.insert(pmem.pmat_eviction_policy.arg, key, value);
 }
@@ -208,12 +388,93 @@ static void **eviction_to_array(SizeT *sz) {
     return pmem.pmat_eviction_policy.to_array(pmem.pmat_eviction_policy.arg, sz);
 }
 
-static UInt get_random(void) {
-    return get_urandom();
+static struct pmat_cache_entry *alloc_cache_entry(void) {
+    return pmat_arena_alloc(pmem.pmat_cache_entry_arena);
+}
+
+/** Number of copies of 'line' of 'file' that have not been written back yet. */
+static inline UShort *pending_count(const struct pmat_registered_file *file, Addr line) {
+    return &file->pending[(line - file->addr) / CACHELINE_SIZE];
+}
+
+static void free_cache_entry(struct pmat_cache_entry *entry) {
+    UShort *pending = pending_count(entry->file, entry->addr);
+    tl_assert(*pending > 0);
+    --*pending;
+    pmat_arena_free(pmem.pmat_cache_entry_arena, entry);
+}
+
+static struct pmat_wb_queue *get_wb_queue(ThreadId tid) {
+    if (UNLIKELY(tid >= pmem.pmat_num_wb_queues)) {
+        UInt n = MAX(tid + 1, 2 * pmem.pmat_num_wb_queues);
+        pmem.pmat_wb_queues = VG_(realloc)("pmat.main.wbq.1", pmem.pmat_wb_queues, n * sizeof(struct pmat_wb_queue));
+        VG_(memset)(pmem.pmat_wb_queues + pmem.pmat_num_wb_queues, 0, (n - pmem.pmat_num_wb_queues) * sizeof(struct pmat_wb_queue));
+        pmem.pmat_num_wb_queues = n;
+    }
+    return &pmem.pmat_wb_queues[tid];
+}
+
+// Append to the queue of the thread that flushed the entry
+static void wb_queue_push(struct pmat_writeback_buffer_entry *wbentry) {
+    struct pmat_wb_queue *queue = get_wb_queue(wbentry->tid);
+    wbentry->next = NULL;
+    wbentry->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = wbentry;
+    } else {
+        queue->head = wbentry;
+    }
+    queue->tail = wbentry;
+}
+
+static void wb_queue_unlink(struct pmat_writeback_buffer_entry *wbentry) {
+    struct pmat_wb_queue *queue = get_wb_queue(wbentry->tid);
+    if (wbentry->prev) {
+        wbentry->prev->next = wbentry->next;
+    } else {
+        queue->head = wbentry->next;
+    }
+    if (wbentry->next) {
+        wbentry->next->prev = wbentry->prev;
+    } else {
+        queue->tail = wbentry->prev;
+    }
+}
+
+/**
+ * Records the stack of a store or flush. 'prev' is the stack already recorded
+ * for the cache line, or NULL if there is none; with --store-stack-mode=first
+ * it is kept rather than unwinding again. Modes other than 'full' fall back to
+ * the instruction pointer alone, which needs no unwinding.
+ */
+static ExeContext *record_stack(ExeContext *prev) {
+    ThreadId tid = VG_(get_running_tid)();
+    switch (pmem.pmat_store_stack_mode) {
+        case PMAT_STACK_IP:
+            return VG_(record_depth_1_ExeContext)(tid, 0);
+        case PMAT_STACK_FIRST:
+            if (prev) {
+                return prev;
+            }
+            break;
+        case PMAT_STACK_SAMPLED:
+            if (pmat_random(PMAT_RNG_STACK) >= pmem.pmat_store_stack_prob * UINT_MAX) {
+                return VG_(record_depth_1_ExeContext)(tid, 0);
+            }
+            break;
+        default:
+            break;
+    }
+    if (pmem.pmat_store_stack_depth == 0) {
+        return VG_(record_ExeContext)(tid, 0);
+    }
+    Addr ips[PMAT_MAX_STACK_DEPTH];
+    UInt n_ips = VG_(get_StackTrace)(tid, ips, pmem.pmat_store_stack_depth, NULL, NULL, 0);
+    return VG_(make_ExeContext_from_StackTrace)(ips, n_ips);
 }
 
 static Bool should_crash(void) {
-    return get_random() < pmem.pmat_crash_prob * UINT_MAX;
+    return pmat_random(PMAT_RNG_CRASH) < pmem.pmat_crash_prob * UINT_MAX;
 }
 
 // Obtain number of processors
@@ -229,9 +490,10 @@ static Int get_num_procs(void) {
     int proc_read_size = 2048;
     char read_buffer[proc_read_size];
 
-    while (VG_(read)(fp, read_buffer, proc_read_size - 1) > 0) {
+    Int nread;
+    while ((nread = VG_(read)(fp, read_buffer, proc_read_size - 1)) > 0) {
         static const char procs[] = "cpu cores\t: ";
-        read_buffer[proc_read_size] = 0;
+        read_buffer[nread] = 0;
 
         char *cache_str = NULL;
         if ((cache_str = VG_(strstr)(read_buffer, procs)) != NULL) {
@@ -254,14 +516,14 @@ static Int get_num_procs(void) {
 // Update statistics for nanoseconds per verification call
 static void update_stats(Double sec) {
     Double delta1 = sec - pmem.mean_verification_time;
-    pmem.mean_verification_time += delta1 / ((Double) pmem.num_verifications);
+    pmem.mean_verification_time += delta1 / ((Double) pmem.num_timed_verifications);
     Double delta2 = sec - (Double) pmem.mean_verification_time;
     pmem.ssd_verification_time += delta1 * delta2;
 }
 
 static void get_stats(Double *mean, Double *variance) {
     *mean = pmem.mean_verification_time;
-    *variance = pmem.ssd_verification_time / (Double) pmem.num_verifications;
+    *variance = pmem.ssd_verification_time / (Double) pmem.num_timed_verifications;
 }
 
 // Comparator for finding a file associated with a name
@@ -276,7 +538,7 @@ static Int find_file_by_addr(const struct pmat_registered_file *lhs, const struc
         tl_assert2(lhs->size, "LHS(addr:0x%lx) has size of 0...", lhs->addr);
         if (rhs->addr < lhs->addr) {
             return -1;
-        } else if (rhs->addr > lhs->addr + lhs->size) {
+        } else if (rhs->addr >= lhs->addr + lhs->size) {
             return 1;
         } else {
             return 0;
@@ -284,7 +546,7 @@ static Int find_file_by_addr(const struct pmat_registered_file *lhs, const struc
     } else if (lhs->size == 0) {
         if (lhs->addr < rhs->addr) {
             return 1;
-        } else if (lhs->addr > rhs->addr + rhs->size) {
+        } else if (lhs->addr >= rhs->addr + rhs->size) {
             return -1;
         } else {
             return 0;
@@ -307,6 +569,15 @@ static Int find_file_by_addr(const struct pmat_registered_file *lhs, const struc
 static Bool
 is_pmem_access(Addr addr, SizeT size)
 {
+    // Fast path: consult the shadow map, only falling back to the
+    // registered files and transient addresses for partial pages.
+    UChar state = pmat_shadow_get(addr);
+    if (LIKELY(state == PMAT_SHADOW_NONE)) {
+        return False;
+    } else if (state == PMAT_SHADOW_PMEM && pmat_shadow_get(addr + size - 1) == PMAT_SHADOW_PMEM) {
+        return True;
+    }
+
     if (VG_(OSetGen_Size)(pmem.pmat_registered_files) == 0) {
         return False;
     }
@@ -335,10 +606,14 @@ is_pmem_access(Addr addr, SizeT size)
 static void do_writeback(struct pmat_cache_entry *entry, Bool explicit);
 static void dump(void);
 
-static void write_to_file(struct pmat_writeback_buffer_entry *entry) {
-    // Find the file associated with it...
+/**
+ * \brief Finds the registered file containing an address.
+ *
+ * \param[in] addr The address to resolve.
+ */
+static struct pmat_registered_file *resolve_file(Addr addr) {
     struct pmat_registered_file file = {0};
-    file.addr = entry->entry->addr; 
+    file.addr = addr; 
     struct pmat_registered_file *realFile = VG_(OSetGen_LookupWithCmp)(pmem.pmat_registered_files, &file, (OSetCmp_t) find_file_by_addr);
     
     // TODO: May want to move this behind some compile-time preprocessor directive
@@ -352,12 +627,179 @@ static void write_to_file(struct pmat_writeback_buffer_entry *entry) {
         }
     }
     tl_assert(realFile && "Unable to find descriptor associated with an address!");
+    return realFile;
+}
+
+/**
+ * Hash of the word 'value' at 'addr' of a shadow heap. A shadow heap hashes
+ * to the sum over its words, so a write-back updates the hash by the
+ * difference of the words it changes.
+ */
+static inline ULong hash_word(Addr addr, ULong value) {
+    ULong x = value + addr * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Hashes the initial contents of a newly registered shadow heap. They are read
+// from the region itself, so that the hash of a lazy shadow heap does not
+// depend on which of its pages have been materialized.
+static void hash_file(struct pmat_registered_file *file) {
+    ULong hash = 0;
+    for (const HChar *c = file->name; *c; c++) {
+        hash = hash * 31 + *c;
+    }
+    hash = hash_word(file->size, hash);
+    const ULong *words = (const ULong *) file->addr;
+    for (UWord i = 0; i < file->size / sizeof(ULong); i++) {
+        hash += hash_word(file->addr + i * sizeof(ULong), words[i]);
+    }
+    file->hash = hash;
+}
+
+// Hash of what a crash right now would leave behind in every shadow heap
+static ULong crash_state_hash(void) {
+    ULong hash = 0;
+    VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
+    struct pmat_registered_file *tmp;
+    while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
+        hash += tmp->hash;
+    }
+    return hash;
+}
+
+static Bool is_verified_state(ULong state) {
+    return VG_(HT_lookup)(pmem.pmat_verified_states, state) != NULL;
+}
+
+static void add_verified_state(ULong state) {
+    if (is_verified_state(state)) {
+        return;
+    }
+    struct pmat_verified_state *node = VG_(malloc)("pmat.verified_state", sizeof(struct pmat_verified_state));
+    node->key = state;
+    VG_(HT_add_node)(pmem.pmat_verified_states, node);
+}
+
+#define PMAT_PAGE_SIZE (1ULL << PMAT_SHADOW_PAGE_BITS)
+
+// Number of (possibly partial) pages spanned by the shadow heap of 'file'
+static UWord file_num_pages(const struct pmat_registered_file *file) {
+    Addr base = file->addr & ~(PMAT_PAGE_SIZE - 1);
+    return (file->addr + file->size - base + PMAT_PAGE_SIZE - 1) >> PMAT_SHADOW_PAGE_BITS;
+}
+
+// Range [*start, *end) of the 'idx'th page of 'file' that belongs to the file
+static void file_page_range(const struct pmat_registered_file *file, UWord idx, Addr *start, Addr *end) {
+    Addr page = (file->addr & ~(PMAT_PAGE_SIZE - 1)) + (idx << PMAT_SHADOW_PAGE_BITS);
+    *start = VG_MAX(page, file->addr);
+    *end = VG_MIN(page + PMAT_PAGE_SIZE, file->addr + file->size);
+}
+
+static Bool is_materialized(const struct pmat_registered_file *file, UWord idx) {
+    return !file->materialized || (file->materialized[idx / 8] & (1 << (idx % 8)));
+}
+
+/**
+ * Copies the 'idx'th page of 'file' from the program into the shadow heap.
+ * Must happen before the program first stores to the page, as the shadow heap
+ * has to start out with the contents the region had when it was registered.
+ */
+static void materialize_page(struct pmat_registered_file *file, UWord idx) {
+    if (is_materialized(file, idx)) {
+        return;
+    }
+    Addr start, end;
+    file_page_range(file, idx, &start, &end);
+    VG_(memcpy)((void *) (file->mmap_addr + (start - file->addr)), (void *) start, end - start);
+    file->materialized[idx / 8] |= 1 << (idx % 8);
+    if (pmat_shadow_get(start) == PMAT_SHADOW_LAZY) {
+        pmat_shadow_set_range(start, end - start, PMAT_SHADOW_PMEM);
+    }
+}
+
+// Materializes every page of a registered file that overlaps [addr, addr + size)
+static void materialize_range(Addr addr, SizeT size) {
+    VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
+    struct pmat_registered_file *tmp;
+    while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
+        if (!tmp->materialized || addr + size <= tmp->addr || addr >= tmp->addr + tmp->size) {
+            continue;
+        }
+        Addr base = tmp->addr & ~(PMAT_PAGE_SIZE - 1);
+        Addr start = VG_MAX(addr, tmp->addr);
+        Addr end = VG_MIN(addr + size, tmp->addr + tmp->size);
+        for (UWord idx = (start - base) >> PMAT_SHADOW_PAGE_BITS; idx <= (end - 1 - base) >> PMAT_SHADOW_PAGE_BITS; idx++) {
+            materialize_page(tmp, idx);
+        }
+    }
+}
+
+/**
+ * Copies the pages of the shadow heap of 'file' that were never stored to from
+ * the program, without marking them materialized. Used on a private copy of
+ * the shadow heap, and on the shadow heap itself when the program exits.
+ */
+static void fill_unmaterialized(const struct pmat_registered_file *file) {
+    if (!file->materialized) {
+        return;
+    }
+    UWord numPages = file_num_pages(file);
+    for (UWord idx = 0; idx < numPages; idx++) {
+        if (!is_materialized(file, idx)) {
+            Addr start, end;
+            file_page_range(file, idx, &start, &end);
+            VG_(memcpy)((void *) (file->mmap_addr + (start - file->addr)), (void *) start, end - start);
+        }
+    }
+}
+
+// Called before a store that may hit a page whose shadow heap is not materialized
+static VG_REGPARM(2) void materialize_store(Addr addr, SizeT size) {
+    if (pmat_shadow_get(addr) == PMAT_SHADOW_LAZY || pmat_shadow_get(addr + size - 1) == PMAT_SHADOW_LAZY) {
+        materialize_range(addr, size);
+    }
+}
 
-    UChar *bytes = (void *) (realFile->mmap_addr + (entry->entry->addr - realFile->addr));
-    for (ULong i = 0; i < CACHELINE_SIZE; i++) {
-        ULong bit = (entry->entry->dirtyBits & (1ULL << i));
-        if (bit) {
-            bytes[i] = entry->entry->data[i];
+// Expands 8 dirty bits into a word mask with 0xFF in each dirty byte
+static inline ULong expand_dirty_bits(ULong bits) {
+    ULong x = (bits * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+    x = (x | ((x | 0x8080808080808080ULL) - 0x0101010101010101ULL)) & 0x8080808080808080ULL;
+    return (x >> 7) * 0xFFULL;
+}
+
+static void write_to_file(struct pmat_writeback_buffer_entry *entry) {
+    struct pmat_cache_entry *line = entry->entry;
+    struct pmat_registered_file *realFile = line->file;
+    ULong dirtyBits = line->dirtyBits;
+    void *bytes = (void *) (realFile->mmap_addr + (line->addr - realFile->addr));
+    if (pmem.pmat_dedup_verifications) {
+        const ULong *words = bytes;
+        const ULong *data = (const ULong *) line->data;
+        ULong bits = dirtyBits;
+        for (ULong i = 0; i < CACHELINE_SIZE / sizeof(ULong); i++, bits >>= 8) {
+            if (bits & 0xFFULL) {
+                ULong mask = expand_dirty_bits(bits & 0xFFULL);
+                Addr addr = line->addr + i * sizeof(ULong);
+                realFile->hash += hash_word(addr, (words[i] & ~mask) | (data[i] & mask)) - hash_word(addr, words[i]);
+            }
+        }
+    }
+    if (dirtyBits == ~0ULL) {
+        VG_(memcpy)(bytes, line->data, CACHELINE_SIZE);
+    } else {
+        // Merge a word at a time; both sides are cache-line aligned
+        ULong *words = bytes;
+        const ULong *data = (const ULong *) line->data;
+        for (ULong i = 0; i < CACHELINE_SIZE / sizeof(ULong); i++, dirtyBits >>= 8) {
+            ULong bits = dirtyBits & 0xFFULL;
+            if (bits == 0xFFULL) {
+                words[i] = data[i];
+            } else if (bits) {
+                ULong mask = expand_dirty_bits(bits);
+                words[i] = (words[i] & ~mask) | (data[i] & mask);
+            }
         }
     }
     maybe_simulate_crash();
@@ -374,6 +816,12 @@ print_store_stats(void)
 {
     dump();
     VG_(umsg)("%ld out of %ld verifications failed...\n", pmem.num_bad_verifications, pmem.num_verifications);
+    if (pmem.num_timed_out_verifications) {
+        VG_(umsg)("%ld of which timed out...\n", pmem.num_timed_out_verifications);
+    }
+    if (pmem.num_deduplicated_verifications) {
+        VG_(umsg)("%ld were deduplicated (state already verified)...\n", pmem.num_deduplicated_verifications);
+    }
 }
 
 /**
@@ -429,9 +877,25 @@ cmp_exe_context_pointers(const ExeContext **lhs, const ExeContext **rhs) {
     return 0;
 }
 
+/** Lines neither written back nor flushed: those cached and those in write-combining buffers. */
+static void **unpersisted_lines(SizeT *sz) {
+    void **lines = eviction_to_array(sz);
+    SizeT n = *sz;
+    for (ThreadId tid = 1; tid < VG_N_THREADS; tid++) {
+        struct pmat_thread_state *ts = VG_(get_tool_thread_data)(tid);
+        if (ts && ts->num_wc) {
+            lines = VG_(realloc)("pmat.main.unpersisted.1", lines, (n + ts->num_wc) * sizeof(void *));
+            VG_(memcpy)(lines + n, ts->wc, ts->num_wc * sizeof(void *));
+            n += ts->num_wc;
+        }
+    }
+    *sz = n;
+    return lines;
+}
+
 static void dump_to_file(int fd) {
     SizeT size;
-    void **cache_lines = eviction_to_array(&size);
+    void **cache_lines = unpersisted_lines(&size);
     HChar charbuf[256];
     VG_(snprintf)(charbuf, 256, "Number of cache-lines not made persistent: %u\n", size);
     VG_(write)(fd, charbuf, VG_(strlen(charbuf)));
@@ -550,7 +1014,7 @@ static void dump_aggregate_to_file(void) {
 
 static void dump_aggregate(void) {
     SizeT size;
-    void **cache_lines = eviction_to_array(&size);
+    void **cache_lines = unpersisted_lines(&size);
     
     // To prevent having to print out ExeContext for cache lines with the same stack
     // trace, we instead create mappings from stack traces to cache lines.
@@ -576,7 +1040,7 @@ static void dump_aggregate(void) {
 
 static void dump(void) {
     SizeT size;
-    void **cache_lines = eviction_to_array(&size);
+    void **cache_lines = unpersisted_lines(&size);
     VG_(umsg)("Number of cache-lines not made persistent: %u\n", size);
 
     // To prevent having to print out ExeContext for cache lines with the same stack
@@ -637,46 +1101,164 @@ static void dump(void) {
     }
 }
 
-static Bool exec(const char *cmd, const char **args) {
-    Int pid = VG_(fork)();
-    if (pid == 0) {
-        // Child
-        VG_(execv)(cmd, args); 
-        // failed?
-        VG_(exit)(-1);
+// Path of the file named 'name' in --shadow-dir
+static void shadow_dir_path(HChar *buf, const HChar *name) {
+    if (pmem.pmat_shadow_dir) {
+        VG_(snprintf)(buf, MAX_PATH_SIZE, "%s/%s", pmem.pmat_shadow_dir, name);
+    } else {
+        VG_(snprintf)(buf, MAX_PATH_SIZE, "%s", name);
+    }
+}
+
+/**
+ * Creates the file backing the shadow heap of 'file' and sets its path, which
+ * is what the verifier is given; a memory file is reached through /proc.
+ */
+static void create_shadow_file(struct pmat_registered_file *file) {
+    HChar path[MAX_PATH_SIZE];
+    SysRes res;
+    if (pmem.pmat_shadow_memfd) {
+        res = VG_(do_syscall2)(__NR_memfd_create, (UWord) file->name, 0);
+        if (!sr_isError(res)) {
+            VG_(snprintf)(path, MAX_PATH_SIZE, "/proc/%d/fd/%lu", VG_(getpid)(), sr_Res(res));
+        }
     } else {
-        Int retval;
-        VG_(waitpid)(pid, &retval, 0);
-        return VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == 0;
+        shadow_dir_path(path, file->name);
+        res = VG_(open)(path, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
+    }
+    if (sr_isError(res)) {
+        VG_(emit)("Could not create shadow heap '%s'; errno: %lu\n", file->name, sr_Err(res));
+        tl_assert(0);
+    }
+    file->descr = sr_Res(res);
+    file->path = VG_(strdup)("pmat.shadow_path", path);
+}
+
+// Name of the copy of a shadow heap kept for verification 'verif_num'
+static void bin_file_name(HChar *buf, const struct pmat_registered_file *file, Int verif_num) {
+    HChar name[MAX_PATH_SIZE];
+    VG_(snprintf)(name, MAX_PATH_SIZE, "%s.%d.%d", file->name, verif_num, verif_num);
+    shadow_dir_path(buf, name);
+}
+
+// Writes the contents of the shadow heap of 'file' to 'fd', named 'name'
+static void write_shadow(Int fd, const struct pmat_registered_file *file, const HChar *name) {
+    UWord written = 0;
+    while (written < file->size) {
+        // Pages never stored to are still only in the program
+        UWord idx = (file->addr + written - (file->addr & ~(PMAT_PAGE_SIZE - 1))) >> PMAT_SHADOW_PAGE_BITS;
+        Addr start, end;
+        file_page_range(file, idx, &start, &end);
+        Addr src = is_materialized(file, idx) ? file->mmap_addr + written : file->addr + written;
+        Int ret = VG_(write)(fd, (void *) src, end - (file->addr + written));
+        tl_assert2(ret > 0, "Failed to write '%s'", name);
+        written += ret;
+    }
+}
+
+/**
+ * Writes a copy of each shadow heap for verification 'verif_num'; used when
+ * verification runs while the program continues to modify the shadow heaps,
+ * and to keep the shadow heaps of a failed verification.
+ */
+static void snapshot_files(Int verif_num) {
+    VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
+    struct pmat_registered_file *tmp;
+    while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
+        HChar file_name[MAX_PATH_SIZE];
+        bin_file_name(file_name, tmp, verif_num);
+        SysRes res = VG_(open)(file_name, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
+        if (sr_isError(res)) {
+            VG_(emit)("Could not open file '%s'; errno: %ld\n", file_name, sr_Err(res));
+            tl_assert(0);
+        }
+        Int fd = sr_Res(res);
+        write_shadow(fd, tmp, file_name);
+        VG_(close)(fd);
     }
 }
 
-static void copy_file(const char *f1, const char *f2) {
-    const char *args[5];
-    args[0] = "cp";
-    args[1] = f1;
-    args[2] = f2;
-    args[3] = "--reflink=auto";
-    args[4] = NULL;
-    exec("/bin/cp", args);
+// Whether crashes are verified in the background by a pool of processes
+static Bool verify_async(void) {
+    return pmem.pmat_verifier_jobs > 1 && !pmem.pmat_aggregate_dump_only;
+}
+
+/**
+ * Writes a shadow heap back to its file. When verifying in the background,
+ * shadow heaps are mapped MAP_PRIVATE, so that a forked job keeps a
+ * copy-on-write view of them as of the crash; the file is then only brought
+ * up to date when the region is unregistered or the program exits.
+ */
+static void sync_shadow_file(const struct pmat_registered_file *file) {
+    if (!verify_async()) {
+        return;
+    }
+    tl_assert2(VG_(lseek)(file->descr, 0, VKI_SEEK_SET) == 0, "Failed to seek in '%s'", file->path);
+    write_shadow(file->descr, file, file->path);
 }
 
-static void call_verifiers() {
+static void unlink_snapshots(Int verif_num) {
     VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
     struct pmat_registered_file *tmp;
     while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
-        tmp->verify_fn(tmp->mmap_addr, tmp->size);
+        HChar file_name[MAX_PATH_SIZE];
+        bin_file_name(file_name, tmp, verif_num);
+        VG_(unlink)(file_name);
     }
 }
 
-static void copy_files(const char *suffix) {
+/**
+ * Points the host's TLS register at that of the crashing thread. Callbacks run
+ * natively on the host, whose FS base is still Valgrind's, so without this any
+ * %fs-relative access (stack protector canaries, errno, most of libc) faults.
+ */
+static void use_client_tls(ThreadId tid) {
+#if defined(VGA_amd64)
+    ULong fs;
+    VG_(get_shadow_regs_area)(tid, (UChar *) &fs, 0, offsetof(VexGuestAMD64State, guest_FS_CONST), sizeof(fs));
+    SysRes res = VG_(do_syscall2)(__NR_arch_prctl, VKI_ARCH_SET_FS, fs);
+    tl_assert2(!sr_isError(res), "arch_prctl(ARCH_SET_FS) failed; errno: %lu", sr_Err(res));
+#endif
+}
+
+/**
+ * Calls the verification callback of each registered file against a private
+ * copy-on-write snapshot of its shadow heap (or of the copy written by
+ * snapshot_files), so the callback can modify neither the shadow heap shared
+ * with the parent nor the file itself. Called in the forked child; returns
+ * the status the child should exit with.
+ */
+static Int call_verifiers(Int verif_num, Bool snapshot) {
+    use_client_tls(VG_(get_running_tid)());
     VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
     struct pmat_registered_file *tmp;
     while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
-        char file_name[1024];
-        VG_(snprintf)(file_name, 1024, "%s.%s.%ld", tmp->name, suffix, pmem.num_verifications);
-        copy_file(tmp->name, file_name);
+        if (!tmp->verify_fn) {
+            continue;
+        }
+        Int fd = tmp->descr;
+        if (snapshot) {
+            HChar file_name[MAX_PATH_SIZE];
+            bin_file_name(file_name, tmp, verif_num);
+            SysRes res = VG_(open)(file_name, VKI_O_RDONLY, 0);
+            tl_assert2(!sr_isError(res), "Could not open snapshot '%s'", file_name);
+            fd = sr_Res(res);
+        }
+        Addr addr = VG_(mmap)(tmp->mmap_addr, tmp->size, VKI_PROT_READ | VKI_PROT_WRITE, VKI_MAP_PRIVATE | VKI_MAP_FIXED, fd, 0);
+        tl_assert2(addr == tmp->mmap_addr, "MMAP failed!");
+        if (!snapshot) {
+            fill_unmaterialized(tmp);
+        }
+        if (tmp->verify_fn((void *) tmp->mmap_addr, tmp->size) != 0) {
+            return PMAT_VERIFICATION_FAILURE;
+        }
     }
+    return 0;
+}
+
+// Whether crashes can be verified at all
+static Bool has_verifier(void) {
+    return pmem.pmat_verifier || pmem.pmat_in_process_verification || pmem.pmat_replay_file;
 }
 
 static void stringify_stack_trace_helper(UInt n, DiEpoch ep, Addr ip, void *fdptr) {
@@ -719,10 +1301,360 @@ static Double diff(struct vki_timespec start, struct vki_timespec end)
 
 static void pmat_fini(int exitcode);
 
+// Records how long a verification took
+static void record_verification_time(Double sec) {
+    pmem.num_timed_verifications++;
+    update_stats(sec);
+    pmem.max_verification_time = VG_MAX(pmem.max_verification_time, sec);
+    pmem.min_verification_time = VG_MIN(pmem.min_verification_time, sec);
+    if (pmem.min_verification_time == 0) pmem.min_verification_time = sec;
+}
+
+// Counts a failed verification, terminating if requested and allowed
+static void record_bad_verification(Bool mayExit) {
+    pmem.num_bad_verifications++;
+    if (pmem.pmat_terminate_on_error && mayExit) {
+        VG_(show_sched_status)(False, False, False);
+        pmat_fini(1);
+        VG_(emit)("Exiting on thread %d\n", VG_(get_running_tid)());
+        VG_(exit)(1);
+    }
+}
+
+static void unlink_output_files(Int verif_num) {
+    char stderr_file[64];
+    char stdout_file[64];
+
+    VG_(snprintf)(stderr_file, 64, "%d.stderr", verif_num);
+    VG_(snprintf)(stdout_file, 64, "%d.stdout", verif_num);
+    VG_(unlink)(stderr_file);
+    VG_(unlink)(stdout_file);
+}
+
+static void write_dump_file(Int verif_num) {
+    char dump_file[64];
+    VG_(snprintf)(dump_file, 64, "%d.dump", verif_num);
+    SysRes res = VG_(open)(dump_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
+    if (sr_isError(res)) {
+        VG_(emit)("Could not open file '%s'; errno: %ld\n", dump_file, sr_Err(res));
+        tl_assert(0);
+    }
+    dump_to_file(sr_Res(res));
+}
+
+/**
+ * Whether a synchronous --verifier is given copies of the shadow heaps rather
+ * than the shadow heaps themselves. Pages of a lazy shadow heap that were never
+ * stored to are only in the program; the copies take them from there instead
+ * of filling them into the shared shadow heap. Callbacks need no copies, as
+ * they are given a private mapping of each shadow heap to fill in.
+ */
+static Bool verify_snapshots(void) {
+    return pmem.pmat_lazy_shadow && !pmem.pmat_in_process_verification;
+}
+
+/**
+ * Runs the verifier against the shadow heaps (or their snapshots taken for
+ * verification 'verif_num'). Called in the forked child and never returns.
+ */
+static void run_verifier(Int verif_num, Bool snapshot) {
+    int numFiles = VG_(OSetGen_Size)(pmem.pmat_registered_files);
+    if (!snapshot && verify_snapshots()) {
+        snapshot_files(verif_num);
+        snapshot = True;
+    }
+    // Redirect to a file...
+    char stderr_file[64];
+    char stdout_file[64];
+    if (pmem.pmat_aggregate_dump_only) {
+        VG_(snprintf)(stderr_file, 64, "/dev/null");
+        VG_(snprintf)(stdout_file, 64, "/dev/null");    
+    } else {
+        VG_(snprintf)(stderr_file, 64, "%d.stderr", verif_num);
+        VG_(snprintf)(stdout_file, 64, "%d.stdout", verif_num);
+    }
+    SysRes res = VG_(open)(stderr_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
+    if (sr_isError(res)) {
+        VG_(emit)("Could not open file '%s'; errno: %ld\n", stderr_file, sr_Err(res));
+        tl_assert(0);
+    }
+    VG_(close)(2);
+    VG_(dup2)(2, sr_Res(res));
+    res = VG_(open)(stdout_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
+    if (sr_isError(res)) {
+        VG_(emit)("Could not open file '%s'; errno: %ld\n", stdout_file, sr_Err(res));
+        tl_assert(0);
+    }
+    VG_(close)(1);
+    VG_(dup2)(1, sr_Res(res));
+    if (pmem.pmat_in_process_verification) {
+        VG_(exit)(call_verifiers(verif_num, snapshot));
+    }
+    const char *args[numFiles + 3]; 
+    args[0] = pmem.pmat_verifier;
+    char numFilesStr[3];
+    VG_(snprintf)(numFilesStr, 3, "%d", numFiles);
+    args[1] = numFilesStr;
+    int n = 2;
+    VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
+    struct pmat_registered_file *file;
+    while ((file = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
+        if (snapshot) {
+            HChar *name = VG_(malloc)("pmat.run_verifier", MAX_PATH_SIZE);
+            bin_file_name(name, file, verif_num);
+            args[n++] = name;
+        } else {
+            args[n++] = file->path;
+        }
+    }
+    args[n] = NULL;
+    VG_(execv)(pmem.pmat_verifier, args);
+    VG_(exit)(-1);
+}
+
+/**
+ * Forks a process running the verifier for 'verif_num'. 'hup' receives the
+ * read end of a pipe whose write end only the child holds, so that its exit
+ * can be waited for with a timeout.
+ */
+static Int fork_verifier(Int verif_num, Bool snapshot, Int *hup) {
+    Int fds[2];
+    tl_assert2(VG_(pipe)(fds) == 0, "Failed to create pipe!");
+    Int pid = VG_(fork)();
+    if (pid == 0) {
+        VG_(close)(fds[0]);
+        run_verifier(verif_num, snapshot);
+    }
+    tl_assert2(pid > 0, "Failed to fork verifier!");
+    VG_(close)(fds[1]);
+    *hup = fds[0];
+    return pid;
+}
+
+/**
+ * Waits for the verifier 'pid' started at 'start', killing it once it has run
+ * for longer than --verifier-timeout. Returns True if it had to be killed.
+ */
+static Bool wait_for_verifier(Int pid, Int hup, struct vki_timespec start, Int *retval) {
+    Bool timedOut = False;
+    struct vki_pollfd pfd = { .fd = hup, .events = VKI_POLLIN };
+    Int nfds = 1;
+    while (pmem.pmat_verifier_timeout) {
+        if (VG_(waitpid)(pid, retval, VKI_WNOHANG) == pid) {
+            VG_(close)(hup);
+            return False;
+        }
+        struct vki_timespec now;
+        tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &now) == 0, "Failed to get current time!");
+        Long left = pmem.pmat_verifier_timeout - (Long) (diff(start, now) * 1000);
+        if (left <= 0) {
+            VG_(kill)(pid, VKI_SIGKILL);
+            timedOut = True;
+            break;
+        }
+        // Sleep until the child exits and its end of the pipe is closed; a child
+        // that closed the pipe itself is checked on every millisecond instead.
+        SysRes res = VG_(poll)(&pfd, nfds, nfds ? left : 1);
+        if (nfds && !sr_isError(res) && sr_Res(res) > 0) {
+            nfds = 0;
+        }
+    }
+    Int retpid = VG_(waitpid)(pid, retval, 0);
+    tl_assert2(pid == retpid, "waitpid(%d) returned unexpected pid %d", pid, retpid);
+    VG_(close)(hup);
+    return timedOut;
+}
+
+/**
+ * Body of a background verification job. The job snapshots the shadow heaps
+ * from its copy-on-write view of them, verifies the snapshots in a child of
+ * its own and, on failure, writes the .dump from its view of the cache and
+ * write-back buffer; all of these still reflect the time of the crash.
+ */
+static void run_verifier_job(Int verif_num, Int fd) {
+    snapshot_files(verif_num);
+    struct vki_timespec start;
+    struct vki_timespec end;
+    tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &start) == 0, "Failed to get start time!");
+    Int hup;
+    Int pid = fork_verifier(verif_num, True, &hup);
+    Int retval;
+    Bool timedOut = wait_for_verifier(pid, hup, start, &retval);
+    tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &end) == 0, "Failed to get end time!");
+
+    Double sec = diff(start, end);
+    VG_(write)(fd, &sec, sizeof(sec));
+    Bool ok = !timedOut && VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == 0;
+    if (timedOut) {
+        VG_(umsg)("Verification %d timed out after %lld ms\n", verif_num, pmem.pmat_verifier_timeout);
+    }
+    if (ok) {
+        unlink_output_files(verif_num);
+    } else {
+        write_dump_file(verif_num);
+    }
+    if (ok || !pmem.pmat_preserve_bin_on_error) {
+        unlink_snapshots(verif_num);
+    }
+    VG_(exit)(ok ? 0 : (timedOut ? PMAT_JOB_TIMED_OUT : 1));
+}
+
+/**
+ * Waits for the oldest background verification if 'block', otherwise
+ * collects it only if it has already finished. Returns True if a job was
+ * collected.
+ */
+static Bool reap_verifier_job(Bool block, Bool mayExit) {
+    if (pmem.pmat_num_running_jobs == 0) {
+        return False;
+    }
+    struct pmat_verifier_job job = pmem.pmat_running_jobs[0];
+    Int retval;
+    Int retpid = VG_(waitpid)(job.pid, &retval, block ? 0 : VKI_WNOHANG);
+    if (retpid == 0) {
+        return False;
+    }
+
+    Double sec = 0;
+    if (VG_(read)(job.fd, &sec, sizeof(sec)) == sizeof(sec)) {
+        record_verification_time(sec);
+    }
+    VG_(close)(job.fd);
+    pmem.pmat_num_running_jobs--;
+    VG_(memmove)(pmem.pmat_running_jobs, pmem.pmat_running_jobs + 1, pmem.pmat_num_running_jobs * sizeof(struct pmat_verifier_job));
+
+    if (retpid != job.pid) {
+        VG_(umsg)("Lost track of verifier for crash %d (waitpid returned %d)\n", job.verif_num, retpid);
+    } else if (!(VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == 0)) {
+        if (VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == PMAT_JOB_TIMED_OUT) {
+            pmem.num_timed_out_verifications++;
+        }
+        record_bad_verification(mayExit);
+    } else if (pmem.pmat_dedup_verifications) {
+        add_verified_state(job.state);
+    }
+    return True;
+}
+
+// Waits for every background verification to finish
+static void drain_verifier_jobs(Bool mayExit) {
+    while (reap_verifier_job(True, mayExit));
+}
+
+/**
+ * Hands verification 'verif_num' to the pool; blocks only while every job
+ * slot is busy. The job snapshots the shadow heaps itself, as they are
+ * privately mapped and so not modified in its view by the program.
+ */
+static void simulate_crash_async(Int verif_num, ULong state) {
+    while (reap_verifier_job(False, True));
+    while (pmem.pmat_num_running_jobs >= pmem.pmat_verifier_jobs) {
+        reap_verifier_job(True, True);
+    }
+
+    Int fds[2];
+    tl_assert2(VG_(pipe)(fds) == 0, "Failed to create pipe!");
+    Int pid = VG_(fork)();
+    if (pid == 0) {
+        VG_(close)(fds[0]);
+        run_verifier_job(verif_num, fds[1]);
+    }
+    tl_assert2(pid > 0, "Failed to fork verifier!");
+    VG_(close)(fds[1]);
+    struct pmat_verifier_job *job = &pmem.pmat_running_jobs[pmem.pmat_num_running_jobs++];
+    job->pid = pid;
+    job->verif_num = verif_num;
+    job->fd = fds[0];
+    job->state = state;
+}
+
+// Folds the position of every random stream into a single word
+static ULong rng_digest(void) {
+    ULong digest = VG_(quantum_seed);
+    for (Int i = 0; i < PMAT_RNG_NUM_STREAMS; i++) {
+        for (Int j = 0; j < 4; j++) {
+            digest = pmat_rng_rotl(digest, 13) ^ pmat_rng_streams[i].s[j];
+        }
+    }
+    return digest;
+}
+
+static void record_crash(void) {
+    struct pmat_crash_record record = { .sblocks = sblocks, .rng_digest = rng_digest() };
+    tl_assert2(VG_(write)(pmem.pmat_record_fd, &record, sizeof(record)) == sizeof(record), "Failed to write to '%s'", pmem.pmat_record_file);
+}
+
+/**
+ * Opens the file of a recorded run and restores the seed and scheduling
+ * options it was made with, so that the replay makes the same decisions.
+ */
+static void open_replay_file(void) {
+    SysRes res = VG_(open)(pmem.pmat_replay_file, VKI_O_RDONLY, 0);
+    if (sr_isError(res)) {
+        VG_(fmsg)("Could not open replay file '%s'; errno: %lu\n", pmem.pmat_replay_file, sr_Err(res));
+        VG_(exit)(1);
+    }
+    Int fd = sr_Res(res);
+    struct pmat_record_header header;
+    if (VG_(read)(fd, &header, sizeof(header)) != sizeof(header) || header.magic != PMAT_RECORD_MAGIC) {
+        VG_(fmsg)("'%s' was not created by --record-crashes\n", pmem.pmat_replay_file);
+        VG_(exit)(1);
+    }
+    Off64T off = sizeof(header) + (pmem.pmat_replay_crash - 1) * sizeof(struct pmat_crash_record);
+    if (pmem.pmat_replay_crash < 1 || VG_(lseek)(fd, off, VKI_SEEK_SET) != off
+            || VG_(read)(fd, &pmem.pmat_replay_record, sizeof(pmem.pmat_replay_record)) != sizeof(pmem.pmat_replay_record)) {
+        VG_(fmsg)("'%s' does not contain crash %ld\n", pmem.pmat_replay_file, pmem.pmat_replay_crash);
+        VG_(exit)(1);
+    }
+    VG_(close)(fd);
+    pmem.pmat_rng_seed = header.rng_seed;
+    VG_(randomize_quantum) = header.randomize_quantum;
+    VG_(scheduling_quantum) = header.scheduling_quantum;
+}
+
+static void create_record_file(void) {
+    SysRes res = VG_(open)(pmem.pmat_record_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_WRONLY, 0666);
+    if (sr_isError(res)) {
+        VG_(fmsg)("Could not open record file '%s'; errno: %lu\n", pmem.pmat_record_file, sr_Err(res));
+        VG_(exit)(1);
+    }
+    pmem.pmat_record_fd = sr_Res(res);
+    struct pmat_record_header header = {
+        .magic = PMAT_RECORD_MAGIC,
+        .rng_seed = pmem.pmat_rng_seed,
+        .randomize_quantum = VG_(randomize_quantum),
+        .scheduling_quantum = VG_(scheduling_quantum)
+    };
+    tl_assert2(VG_(write)(pmem.pmat_record_fd, &header, sizeof(header)) == sizeof(header), "Failed to write to '%s'", pmem.pmat_record_file);
+}
+
+/**
+ * Replays a simulated crash. Crashes before the requested one are skipped
+ * without running a verifier; at the requested one, the dump is written and
+ * the program stops until a debugger attaches through vgdb.
+ */
+static void replay_crash(Int verif_num) {
+    if (verif_num != pmem.pmat_replay_crash) {
+        return;
+    }
+    if (sblocks != pmem.pmat_replay_record.sblocks || rng_digest() != pmem.pmat_replay_record.rng_digest) {
+        VG_(umsg)("Warning: replay diverged from the recorded run at crash %d (%llu superblocks executed, %llu recorded)\n",
+            verif_num, sblocks, pmem.pmat_replay_record.sblocks);
+    }
+    write_dump_file(verif_num);
+    if (VG_(clo_vgdb) == Vg_VgdbNo) {
+        VG_(umsg)("Reached crash %d after %llu superblocks; state written to %d.dump (use --vgdb=yes to stop here)\n",
+            verif_num, sblocks, verif_num);
+        return;
+    }
+    VG_(umsg)("Reached crash %d after %llu superblocks; state written to %d.dump, waiting for gdb to attach...\n",
+        verif_num, sblocks, verif_num);
+    VG_(gdbserver)(VG_(get_running_tid)());
+}
+
 // TODO: Need to write stderr and stdout to their own temporary files; these files persist if recovery fails!
-// TODO: Need to set timeout for recovery operations, in case they do an infinite loop. Parent currently gets stuck in a syscall!
 static void simulate_crash(void) {
-    if (!pmem.pmat_verifier) {
+    if (!has_verifier()) {
         VG_(fmsg)("[Error] Attempt to force a crash without a verification function!\n");
         return;
     } else if (VG_(OSetGen_Size)(pmem.pmat_registered_files) == 0) {
@@ -731,118 +1663,184 @@ static void simulate_crash(void) {
     }
 
     Int verif_num = ++pmem.num_verifications;
+    if (pmem.pmat_record_file) {
+        record_crash();
+    }
+    if (pmem.pmat_replay_file) {
+        replay_crash(verif_num);
+        return;
+    }
+    ULong state = 0;
+    if (pmem.pmat_dedup_verifications) {
+        state = crash_state_hash();
+        if (is_verified_state(state)) {
+            pmem.num_deduplicated_verifications++;
+            return;
+        }
+    }
+    if (verify_async()) {
+        simulate_crash_async(verif_num, state);
+        return;
+    }
 
     // Start timer...
     struct vki_timespec start;
     struct vki_timespec end;
     tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &start) == 0, "Failed to get start time!");
     
-    Int pid = VG_(fork)();
-    if (pid != 0) {
-        // parent
-        Int retval;
-        Int retpid = VG_(waitpid)(pid, &retval, 0);
-        tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &end) == 0, "Failed to get end time!");
-        tl_assert2(pid == retpid, "waitpid(%d) returned unexpected pid %d", pid, retpid);
-
-        Double sec = diff(start, end);
-        update_stats(sec);
-        pmem.max_verification_time = VG_MAX(pmem.max_verification_time, sec);
-        pmem.min_verification_time = VG_MIN(pmem.min_verification_time, sec);
-        if (pmem.min_verification_time == 0) pmem.min_verification_time = sec;
-
-        // Check if child exited normally...
-        if (VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == 0) {
-            // Normal exit; delete .stdout and .stderr
-            char stderr_file[64];
-            char stdout_file[64];
-
-            VG_(snprintf)(stderr_file, 64, "%d.stderr", verif_num);
-            VG_(snprintf)(stdout_file, 64, "%d.stdout", verif_num);
-            VG_(unlink)(stderr_file);
-            VG_(unlink)(stdout_file);
-        } else {
-            // Create copy of shadow region
-            if (pmem.pmat_preserve_bin_on_error) {
-                char bin_name[64];
-                VG_(snprintf)(bin_name, 64, "%d", verif_num);
-                copy_files(bin_name);
-            }
-            // Should we aggregate the dump file?
-            if (pmem.pmat_aggregate_dump_only) {
-                dump_aggregate();
-            } else {
-                char dump_file[64];
-                VG_(snprintf)(dump_file, 64, "%d.dump", verif_num);
-                SysRes res = VG_(open)(dump_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
-                if (sr_isError(res)) {
-                    VG_(emit)("Could not open file '%s'; errno: %ld\n", dump_file, sr_Err(res));
-                    tl_assert(0);
-                }
-                dump_to_file(sr_Res(res));
-            }
-
-            pmem.num_bad_verifications++;
-            if (pmem.pmat_terminate_on_error) {
-                VG_(show_sched_status)(False, False, False);
-                pmat_fini(1);
-                VG_(emit)("Exiting on thread %d\n", VG_(get_running_tid)());
-                VG_(exit)(1);
-            }
-        } 
-        return;
-    } else {
-        // child...
-        int numFiles = VG_(OSetGen_Size)(pmem.pmat_registered_files);
-        // Redirect to a file...
-        char stderr_file[64];
-        char stdout_file[64];
-        if (pmem.pmat_aggregate_dump_only) {
-            VG_(snprintf)(stderr_file, 64, "/dev/null");
-            VG_(snprintf)(stdout_file, 64, "/dev/null");    
-        } else {
-            VG_(snprintf)(stderr_file, 64, "%d.stderr", verif_num);
-            VG_(snprintf)(stdout_file, 64, "%d.stdout", verif_num);
+    Int hup;
+    Int pid = fork_verifier(verif_num, False, &hup);
+    Int retval;
+    Bool timedOut = wait_for_verifier(pid, hup, start, &retval);
+    tl_assert2(VG_(clock_gettime)(VKI_CLOCK_MONOTONIC, &end) == 0, "Failed to get end time!");
+
+    record_verification_time(diff(start, end));
+
+    // Check if child exited normally...
+    if (!timedOut && VKI_WIFEXITED(retval) && VKI_WEXITSTATUS(retval) == 0) {
+        // Normal exit; delete .stdout and .stderr
+        unlink_output_files(verif_num);
+        if (verify_snapshots()) {
+            unlink_snapshots(verif_num);
         }
-        SysRes res = VG_(open)(stderr_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
-        if (sr_isError(res)) {
-            VG_(emit)("Could not open file '%s'; errno: %ld\n", stderr_file, sr_Err(res));
-            tl_assert(0);
+        if (pmem.pmat_dedup_verifications) {
+            add_verified_state(state);
         }
-        VG_(close)(2);
-        VG_(dup2)(2, sr_Res(res));
-        res = VG_(open)(stdout_file, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
-        if (sr_isError(res)) {
-            VG_(emit)("Could not open file '%s'; errno: %ld\n", stdout_file, sr_Err(res));
-            tl_assert(0);
+    } else {
+        if (timedOut) {
+            VG_(umsg)("Verification %d timed out after %lld ms\n", verif_num, pmem.pmat_verifier_timeout);
+            pmem.num_timed_out_verifications++;
         }
-        VG_(close)(1);
-        VG_(dup2)(1, sr_Res(res));
-        const char *args[numFiles + 3]; 
-        args[0] = pmem.pmat_verifier;
-        char numFilesStr[3];
-        VG_(snprintf)(numFilesStr, 3, "%d", numFiles);
-        args[1] = numFilesStr;
-        int n = 2;
-        VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
-        struct pmat_registered_file *file;
-        while ((file = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
-            args[n++] = file->name;
+        // Create copy of shadow region, unless the verifier was given one
+        if (pmem.pmat_preserve_bin_on_error && !verify_snapshots()) {
+            snapshot_files(verif_num);
+        } else if (!pmem.pmat_preserve_bin_on_error && verify_snapshots()) {
+            unlink_snapshots(verif_num);
         }
-        args[n] = NULL;
-        VG_(execv)(pmem.pmat_verifier, args);
-        VG_(exit)(-1);
-    }
+        // Should we aggregate the dump file?
+        if (pmem.pmat_aggregate_dump_only) {
+            dump_aggregate();
+        } else {
+            write_dump_file(verif_num);
+        }
+
+        record_bad_verification(True);
+    } 
 }
 
 static void maybe_simulate_crash(void) {
-    if (!pmem.pmat_should_verify || !pmem.pmat_verifier || VG_(OSetGen_Size)(pmem.pmat_registered_files) == 0) return;
+    if (!pmem.pmat_should_verify || !has_verifier() || VG_(OSetGen_Size)(pmem.pmat_registered_files) == 0) return;
     if (should_crash()) {
         simulate_crash();
     }
 }
 
 
+static void store_masked(Addr line, ULong mask, Bool nonTemporal);
+static void store_to_line(Addr line, ULong mask, const UChar *data);
+static void store_to_wc(Addr line, ULong mask, const UChar *data);
+
+/** Copies the bytes of a cache line set in mask from src to dst. */
+static void
+copy_masked(UChar *dst, const UChar *src, ULong mask)
+{
+    if (mask == ~0ULL) {
+        VG_(memcpy)(dst, src, CACHELINE_SIZE);
+        return;
+    }
+    while (mask) {
+        UInt start = __builtin_ctzll(mask);
+        UInt len = __builtin_ctzll(~(mask >> start));
+        VG_(memcpy)(dst + start, src + start, len);
+        // Clear the run just copied
+        mask = start + len == CACHELINE_SIZE ? 0 : mask & ~((1ULL << (start + len)) - 1ULL);
+    }
+}
+
+/** Index of 'line' in the write-combining buffer of a thread, or -1. */
+static Int
+find_wc_entry(struct pmat_thread_state *ts, Addr line)
+{
+    for (UInt i = 0; i < ts->num_wc; i++) {
+        if (ts->wc[i]->addr == line) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+* \brief Move a line out of the write-combining buffer of the running thread.
+*
+* The line is then in the write-back buffer, as if it had been flushed, until
+* the next fence of the thread.
+*/
+static void
+drain_wc_entry(struct pmat_thread_state *ts, UInt i)
+{
+    struct pmat_cache_entry *entry = ts->wc[i];
+    ts->num_wc--;
+    VG_(memmove)(&ts->wc[i], &ts->wc[i + 1], (ts->num_wc - i) * sizeof(ts->wc[0]));
+    // Issued by the store itself, so that is where it was flushed
+    writeback_entry(entry, VG_(get_running_tid)(), entry->locOfStore);
+}
+
+static void
+drain_wc_buffer(struct pmat_thread_state *ts)
+{
+    while (ts->num_wc) {
+        drain_wc_entry(ts, 0);
+    }
+}
+
+/**
+* \brief Write the bytes of a cache line set in mask into the write-combining
+*        buffer of the running thread.
+*
+* Non-temporal stores never enter the simulated cache: a cached copy of the
+* line is evicted first, as the hardware does. The line is drained to the
+* write-back buffer once it is fully written, when the buffer overflows or on
+* the next fence.
+* \param[in] line The address of the cache line.
+* \param[in] mask Bit i is set if the byte at line + i was stored to.
+* \param[in] data The line's new contents; only bytes set in mask are read.
+*/
+static void
+store_to_wc(Addr line, ULong mask, const UChar *data)
+{
+    struct pmat_thread_state *ts = current_thread_state();
+    Int i = find_wc_entry(ts, line);
+    struct pmat_cache_entry *entry;
+    if (i >= 0) {
+        // Regular stores drain the line first, so it cannot also be cached
+        entry = ts->wc[i];
+        entry->locOfStore = record_stack(entry->locOfStore);
+    } else {
+        struct pmat_cache_entry *cached = eviction_lookup(line);
+        if (cached) {
+            do_writeback(cached, False);
+        }
+        if (ts->num_wc == NUM_WC_ENTRIES) {
+            drain_wc_entry(ts, 0);
+        }
+        entry = alloc_cache_entry();
+        entry->locOfStore = record_stack(NULL);
+        entry->addr = line;
+        entry->file = resolve_file(line);
+        ++*pending_count(entry->file, line);
+        entry->dirtyBits = 0;
+        VG_(memset)(entry->data, 0, CACHELINE_SIZE);
+        i = ts->num_wc++;
+        ts->wc[i] = entry;
+    }
+    entry->tid = VG_(get_running_tid)();
+    copy_masked(entry->data, data, mask);
+    entry->dirtyBits |= mask;
+    if (entry->dirtyBits == ~0ULL) {
+        drain_wc_entry(ts, i);
+    }
+}
+
 /**
 * \brief Trace the given store if it was to any of the registered persistent
 *        memory regions.
@@ -877,6 +1875,8 @@ static VG_REGPARM(3) void trace_pmem_store(Addr addr, SizeT size, UWord value)
         // VG_(emit)("Warning: Split cache lines are not supported: %lu and %lu not in same cache line... (%lld,%lld)\nMaybe split to %x and %x!\n", 
             // addr, addr + size, TRIM_CACHELINE(addr), TRIM_CACHELINE(addr + size), (1 << (pt1 * 8)) - 1, (1 << pt2) - 1);
     }    
+    // A store split across cache lines counts once per line
+    ++current_thread_state()->stores;
     ULong startOffset = OFFSET_CACHELINE(addr);
     ULong endOffset = OFFSET_CACHELINE(addr + size);
     if (OFFSET_CACHELINE(addr + size) == 0) endOffset = CACHELINE_SIZE;
@@ -885,34 +1885,132 @@ static VG_REGPARM(3) void trace_pmem_store(Addr addr, SizeT size, UWord value)
         //return;
     }
 
+    UChar data[CACHELINE_SIZE];
+    VG_(memcpy)(data + startOffset, &value, size);
+    store_to_line(TRIM_CACHELINE(addr), ((1ULL << ((ULong) size)) - 1ULL) << startOffset, data);
+}
+
+/** Trace the bytes of [addr, addr + 64) set in mask, a cache line at a time. */
+static inline void trace_masked(Addr addr, ULong mask, Bool nonTemporal)
+{
+    Addr line = TRIM_CACHELINE(addr);
+    ULong offset = OFFSET_CACHELINE(addr);
+    store_masked(line, mask << offset, nonTemporal);
+    if (offset != 0 && (mask >> (CACHELINE_SIZE - offset)) != 0) {
+        store_masked(line + CACHELINE_SIZE, mask >> (CACHELINE_SIZE - offset), nonTemporal);
+    }
+}
+
+/**
+* \brief Trace a group of stores made to [addr, addr + 64) by one superblock.
+*
+* Emitted once after the group instead of a trace_pmem_store per store (see
+* add_store_group), and for each vector store. The stored values are read
+* back from memory, which holds them by the time the helper runs.
+* \param[in] addr The lowest address stored to.
+* \param[in] mask Bit i is set if the byte at addr + i was stored to.
+*/
+static VG_REGPARM(2) void trace_pmem_store_mask(Addr addr, ULong mask)
+{
+    trace_masked(addr, mask, False);
+}
+
+/**
+* \brief Trace a non-temporal (MOVNT*) store, or a group of them, which
+*        bypasses the cache.
+* \param[in] addr The lowest address stored to.
+* \param[in] mask Bit i is set if the byte at addr + i was stored to.
+*/
+static VG_REGPARM(2) void trace_pmem_store_nt(Addr addr, ULong mask)
+{
+    trace_masked(addr, mask, True);
+}
+
+/**
+* \brief Trace the bytes of a cache line set in mask, if persistent.
+* \param[in] line The address of the cache line.
+* \param[in] mask Bit i is set if the byte at line + i was stored to.
+* \param[in] nonTemporal Whether the store goes to the write-combining buffer.
+*/
+static void
+store_masked(Addr line, ULong mask, Bool nonTemporal)
+{
+    Addr first = line + __builtin_ctzll(mask);
+    Addr last = line + CACHELINE_SIZE - 1 - __builtin_clzll(mask);
+    UChar firstState = pmat_shadow_get(first);
+    UChar lastState = pmat_shadow_get(last);
+    if (LIKELY(firstState == PMAT_SHADOW_NONE && lastState == PMAT_SHADOW_NONE)) {
+        return;
+    }
+    if (firstState != PMAT_SHADOW_PMEM || lastState != PMAT_SHADOW_PMEM) {
+        // Partial page or transient range; keep only the persistent bytes
+        ULong persistent = 0;
+        for (ULong bits = mask; bits; bits &= bits - 1) {
+            UInt i = __builtin_ctzll(bits);
+            if (is_pmem_access(line + i, 1)) {
+                persistent |= 1ULL << i;
+            }
+        }
+        mask = persistent;
+        if (mask == 0) {
+            return;
+        }
+    }
+    ++current_thread_state()->stores;
+    if (nonTemporal) {
+        store_to_wc(line, mask, (const UChar *) line);
+    } else {
+        store_to_line(line, mask, (const UChar *) line);
+    }
+}
+
+/**
+* \brief Write the bytes of a cache line set in mask into the simulated cache.
+* \param[in] line The address of the cache line.
+* \param[in] mask Bit i is set if the byte at line + i was stored to.
+* \param[in] data The line's new contents; only bytes set in mask are read.
+*/
+static void
+store_to_line(Addr line, ULong mask, const UChar *data)
+{
     // If the cache line has not been written back, write it into that cache-line.
-    struct pmat_cache_entry *exists = eviction_lookup(TRIM_CACHELINE(addr));
+    struct pmat_cache_entry *exists = eviction_lookup(line);
     if (exists) {
-        VG_(memcpy)(exists->data + startOffset, &value, size);
-        exists->locOfStore = VG_(record_ExeContext)(VG_(get_running_tid)(), 0);
+        copy_masked(exists->data, data, mask);
+        exists->locOfStore = record_stack(exists->locOfStore);
         exists->tid = VG_(get_running_tid)();
         // Set bits being written to as dirty...
-        exists->dirtyBits |= ((1ULL << ((ULong) size)) - 1ULL) << startOffset;
+        exists->dirtyBits |= mask;
         return;
     } else {
+        // A line being combined is written out before it can be cached again
+        struct pmat_thread_state *ts = current_thread_state();
+        if (UNLIKELY(ts->num_wc != 0)) {
+            Int i = find_wc_entry(ts, line);
+            if (i >= 0) {
+                drain_wc_entry(ts, i);
+            }
+        }
         // Create a new entry...
-        struct pmat_cache_entry *new_entry = VG_(malloc)("pmat.new_entry", (SizeT) sizeof (struct pmat_cache_entry) + CACHELINE_SIZE);
-        new_entry->locOfStore = VG_(record_ExeContext)(VG_(get_running_tid)(), 0);
+        struct pmat_cache_entry *new_entry = alloc_cache_entry();
+        new_entry->locOfStore = record_stack(NULL);
         new_entry->tid = VG_(get_running_tid)();
-        new_entry->addr = TRIM_CACHELINE(addr);
+        new_entry->addr = line;
+        new_entry->file = resolve_file(new_entry->addr);
+        ++*pending_count(new_entry->file, line);
         new_entry->dirtyBits = 0;
         VG_(memset)(new_entry->data, 0, CACHELINE_SIZE);
-        VG_(memcpy)(new_entry->data + OFFSET_CACHELINE(addr), &value, size);
-        new_entry->dirtyBits |= ((1ULL << ((ULong) size)) - 1ULL) << startOffset;
-        eviction_insert(TRIM_CACHELINE(addr), new_entry);
+        copy_masked(new_entry->data, data, mask);
+        new_entry->dirtyBits |= mask;
+        eviction_insert(line, new_entry);
         // Check if we need to evict...
         if (eviction_size() > pmem.pmat_num_cache_entries) {
             struct pmat_cache_entry *entry = eviction_evict();
-            do_writeback(new_entry, False);
+            do_writeback(entry, False);
         }
     }
 
-    if (get_random() % 100 == 0 && eviction_size()) {
+    if (pmat_random(PMAT_RNG_EVICTION) % 100 == 0 && eviction_size()) {
         struct pmat_cache_entry *entry = eviction_evict();
         do_writeback(entry, False);
     }
@@ -925,20 +2023,6 @@ static VG_REGPARM(3) void trace_pmem_store_dword(Addr addr, UWord value1, UWord
 }
 
 
-/**
-* \brief Register the entry of a new SB.
-*
-* Useful when handling implementation independent multiple writes under
-* the same address.
-*/
-static void
-add_one_SB_entered(void)
-{
-    tl_assert2(VG_(get_running_tid)() < 1024, "More than 1024 threads! tid=%d", VG_(get_running_tid)());
-    ++sblocks;
-    ++threadSBlocks[VG_(get_running_tid)()];
-}
-
 /**
 * \brief Make a new atomic expression from e.
 *
@@ -962,6 +2046,26 @@ make_expr(IRSB *sb, IRType ty, IRExpr *e)
     return mkexpr(t);
 }
 
+/**
+* \brief Count the entry of a new SB.
+*
+* Increments the total and the running thread's superblock counts with
+* inline IR rather than a helper call, as lackey does with --inline=yes.
+* \param[in,out] sb The IR superblock to which the increments are added.
+*/
+static void
+add_sb_counter(IRSB *sb)
+{
+    IRAtom *total = make_expr(sb, Ity_I64, IRExpr_Load(Iend_LE, Ity_I64, mkU64((ULong) (Addr) &sblocks)));
+    total = make_expr(sb, Ity_I64, binop(Iop_Add64, total, mkU64(1)));
+    addStmtToIRSB(sb, IRStmt_Store(Iend_LE, mkU64((ULong) (Addr) &sblocks), total));
+
+    IRAtom *counter = make_expr(sb, Ity_I64, IRExpr_Load(Iend_LE, Ity_I64, mkU64((ULong) (Addr) &current_sblocks)));
+    IRAtom *count = make_expr(sb, Ity_I64, IRExpr_Load(Iend_LE, Ity_I64, counter));
+    count = make_expr(sb, Ity_I64, binop(Iop_Add64, count, mkU64(1)));
+    addStmtToIRSB(sb, IRStmt_Store(Iend_LE, counter, count));
+}
+
 /**
 * \brief Check if the expression needs to be widened.
 * \param[in] sb The IR superblock to which the expression belongs.
@@ -1066,88 +2170,106 @@ widen_operation(IRSB *sb, IRAtom *e)
     }
 }
 
+// Emits IR equivalent to pmat_shadow_get(addr)
+static IRAtom *
+make_shadow_state(IRSB *sb, IRAtom *addr)
+{
+    IRAtom *pmIdx = make_expr(sb, Ity_I64, binop(Iop_Shr64, addr, mkU8(PMAT_SHADOW_SM_BITS)));
+    pmIdx = make_expr(sb, Ity_I64, binop(Iop_And64, pmIdx, mkU64(PMAT_SHADOW_PM_SIZE - 1)));
+    pmIdx = make_expr(sb, Ity_I64, binop(Iop_Shl64, pmIdx, mkU8(3)));
+    IRAtom *pmAddr = make_expr(sb, Ity_I64, binop(Iop_Add64, pmIdx, mkU64((ULong) (Addr) pmat_shadow_primary)));
+    IRAtom *sm = make_expr(sb, Ity_I64, IRExpr_Load(Iend_LE, Ity_I64, pmAddr));
+
+    IRAtom *smIdx = make_expr(sb, Ity_I64, binop(Iop_Shr64, addr, mkU8(PMAT_SHADOW_PAGE_BITS)));
+    smIdx = make_expr(sb, Ity_I64, binop(Iop_And64, smIdx, mkU64(PMAT_SHADOW_SM_SIZE - 1)));
+    IRAtom *smAddr = make_expr(sb, Ity_I64, binop(Iop_Add64, sm, smIdx));
+    return make_expr(sb, Ity_I8, IRExpr_Load(Iend_LE, Ity_I8, smAddr));
+}
+
+/**
+* \brief Guard a store helper with an inline lookup of the shadow map.
+*
+* Emits IR equivalent to pmat_shadow_get(addr) != PMAT_SHADOW_NONE so that
+* the dirty helper is only called for stores that may touch a registered
+* region. Addresses outside of the shadow map alias into it, which at worst
+* results in a spurious call to the helper.
+* \param[in,out] sb The IR superblock to which add expressions.
+* \param[in] addr The expression with the address of the store.
+* \param[in] guard The existing guard expression, or NULL.
+* \return The combined guard expression.
+*/
+static IRAtom *
+make_pmem_guard(IRSB *sb, IRAtom *addr, IRAtom *guard)
+{
+    tl_assert(typeOfIRExpr(sb->tyenv, addr) == Ity_I64);
+
+    IRAtom *state = make_shadow_state(sb, addr);
+    IRAtom *isPmem = make_expr(sb, Ity_I1, binop(Iop_CmpNE8, state, mkU8(PMAT_SHADOW_NONE)));
+
+    if (!guard) {
+        return isPmem;
+    }
+    IRAtom *both = make_expr(sb, Ity_I32, binop(Iop_And32,
+            make_expr(sb, Ity_I32, unop(Iop_1Uto32, guard)),
+            make_expr(sb, Ity_I32, unop(Iop_1Uto32, isPmem))));
+    return make_expr(sb, Ity_I1, binop(Iop_CmpNE32, both, mkU32(0)));
+}
+
+/**
+* \brief Materialize the shadow heap of the pages a store is about to modify.
+*
+* With --lazy-shadow, emitted before the store itself so that the pages are
+* copied while they still hold their contents from before the store. The
+* helper is only called if either end of the store lies on a page whose
+* shadow state is PMAT_SHADOW_LAZY.
+* \param[in,out] sb The IR superblock to which add expressions.
+* \param[in] addr The expression with the address of the store.
+* \param[in] size The size of the store.
+*/
+static void
+add_materialize_check(IRSB *sb, IRAtom *addr, SizeT size)
+{
+    if (!pmem.pmat_lazy_shadow) {
+        return;
+    }
+    tl_assert(typeOfIRExpr(sb->tyenv, addr) == Ity_I64);
+    IRAtom *last = make_expr(sb, Ity_I64, binop(Iop_Add64, addr, mkU64(size - 1)));
+    IRAtom *lazyFirst = make_expr(sb, Ity_I32, unop(Iop_1Uto32,
+            make_expr(sb, Ity_I1, binop(Iop_CmpEQ8, make_shadow_state(sb, addr), mkU8(PMAT_SHADOW_LAZY)))));
+    IRAtom *lazyLast = make_expr(sb, Ity_I32, unop(Iop_1Uto32,
+            make_expr(sb, Ity_I1, binop(Iop_CmpEQ8, make_shadow_state(sb, last), mkU8(PMAT_SHADOW_LAZY)))));
+    IRAtom *guard = make_expr(sb, Ity_I1, binop(Iop_CmpNE32,
+            make_expr(sb, Ity_I32, binop(Iop_Or32, lazyFirst, lazyLast)), mkU32(0)));
+    IRDirty *di = unsafeIRDirty_0_N(2, "materialize_store", VG_(fnptr_to_fnentry)(materialize_store),
+            mkIRExprVec_2(addr, mkIRExpr_HWord(size)));
+    di->guard = guard;
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
+}
+
 /**
-* \brief Handle wide sse operations.
+* \brief Handle wide vector stores.
+*
+* Traced with a single trace_pmem_store_mask call covering every byte of the
+* store, which reads the stored value back from memory, rather than one
+* trace_pmem_store per 64-bit lane.
 * \param[in,out] sb The IR superblock to which add expressions.
-* \param[in] end The endianess.
 * \param[in] addr The expression with the address of the operation.
-* \param[in] data The expression with the value of the operation.
 * \param[in] guard The guard expression.
-* \param[in] size The size of the operation.
+* \param[in] size The size of the operation; at most a cache line.
 */
 static void
-handle_wide_expr(IRSB *sb, IREndness end, IRAtom *addr, IRAtom *data,
-        IRAtom *guard, SizeT size)
+handle_wide_expr(IRSB *sb, IRAtom *addr, IRAtom *guard, SizeT size)
 {
-    IROp mkAdd;
-    IRType ty, tyAddr;
-    void *helper = trace_pmem_store;
-    const HChar *hname = "trace_pmem_store";
-
-    ty = typeOfIRExpr(sb->tyenv, data);
-
-    tyAddr = typeOfIRExpr(sb->tyenv, addr);
-    mkAdd = tyAddr==Ity_I32 ? Iop_Add32 : Iop_Add64;
-    tl_assert( tyAddr == Ity_I32 || tyAddr == Ity_I64 );
-    tl_assert( end == Iend_LE || end == Iend_BE );
-
-    Int i;
-    Int parts = 0;
-    /* These are the offsets of the parts in memory. */
-    UInt offs[4];
-
-    /* Various bits for constructing the 4/2 lane helper calls */
-    IROp ops[4];
-    IRDirty *dis[4];
-    IRAtom *addrs[4];
-    IRAtom *datas[4];
-    IRAtom *eBiass[4];
-
-    if (ty == Ity_V256) {
-         /* V256-bit case -- phrased in terms of 64 bit units (Qs), with
-           Q3 being the most significant lane. */
-
-        ops[0] =Iop_V256to64_0;
-        ops[1] =Iop_V256to64_1;
-        ops[2] =Iop_V256to64_2;
-        ops[3] = Iop_V256to64_3;
-
-        if (end == Iend_LE) {
-            offs[0] = 0; offs[1] = 8; offs[2] = 16; offs[3] = 24;
-        } else {
-            offs[3] = 0; offs[2] = 8; offs[1] = 16; offs[0] = 24;
-        }
-
-        parts = 4;
-    } else if (ty == Ity_V128) {
-
-        /* V128-bit case
-           See comment in next clause re 64-bit regparms also, need to be
-           careful about endianness */
-        ops[0] =Iop_V128to64;
-        ops[1] =Iop_V128HIto64;
-
-        if (end == Iend_LE) {
-            offs[0] = 0; offs[1] = 8;
-        } else {
-            offs[0] = 8; offs[1] = 0;
-        }
+    tl_assert(typeOfIRExpr(sb->tyenv, addr) == Ity_I64);
+    tl_assert(size <= CACHELINE_SIZE);
 
-        parts = 2;
-    }
-
-    for(i = 0; i < parts; ++i) {
-        eBiass[i] = tyAddr == Ity_I32 ? mkU32(offs[i]) : mkU64(offs[i]);
-        addrs[i] = make_expr(sb, tyAddr, binop(mkAdd, addr, eBiass[i]));
-        datas[i] = make_expr(sb, Ity_I64, unop(ops[i], data));
-        dis[i] = unsafeIRDirty_0_N(3/*regparms*/, hname,
-                VG_(fnptr_to_fnentry)(helper), mkIRExprVec_3(addrs[i],
-                mkIRExpr_HWord(size / parts), datas[i]));
-        if (guard)
-            dis[i]->guard = guard;
+    ULong mask = size == CACHELINE_SIZE ? ~0ULL : (1ULL << size) - 1ULL;
+    IRDirty *di = unsafeIRDirty_0_N(2/*regparms*/, "trace_pmem_store_mask",
+            VG_(fnptr_to_fnentry)(trace_pmem_store_mask), mkIRExprVec_2(addr, mkU64(mask)));
+    if (guard)
+        di->guard = guard;
 
-        addStmtToIRSB(sb, IRStmt_Dirty(dis[i]));
-    }
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
 }
 
 /**
@@ -1172,6 +2294,10 @@ add_event_dw_guarded(IRSB *sb, IRAtom *daddr, Int dsize, IRAtom *guard,
     IRDirty *di;
     IRType type = typeOfIRExpr(sb->tyenv, value);
 
+    if (pmem.pmat_inline_pmem_check) {
+        guard = make_pmem_guard(sb, daddr, guard);
+    }
+
     if (value->tag == Iex_RdTmp && type == Ity_I64) {
         /* handle the normal case */
         argv = mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize),
@@ -1214,7 +2340,7 @@ add_event_dw_guarded(IRSB *sb, IRAtom *daddr, Int dsize, IRAtom *guard,
         }
         addStmtToIRSB(sb, IRStmt_Dirty(di));
     } else if (type == Ity_V128 || type == Ity_V256 ) {
-        handle_wide_expr(sb, Iend_LE, daddr, value, guard, dsize);
+        handle_wide_expr(sb, daddr, guard, dsize);
     } else {
         VG_(umsg)("Unable to trace store - unsupported type of store 0x%x 0x%x\n",
                   value->tag, type);
@@ -1282,32 +2408,351 @@ add_event_dw(IRSB *sb, IRAtom *daddr, Int dsize, IRAtom *value)
     add_event_dw_guarded(sb, daddr, dsize, NULL, value);
 }
 
+/**
+* \brief Whether an instruction is a non-temporal store (MOVNTI, MOVNTQ,
+*        MOVNTDQ, MOVNTPS/PD, MOVNTSS/SD and their VEX forms).
+*
+* VEX translates these to plain stores, so the opcode is read from the
+* guest code itself.
+* \param[in] insn The bytes of the instruction.
+* \param[in] len The length of the instruction.
+*/
+static Bool
+is_non_temporal_store(const UChar *insn, UInt len)
+{
+#if defined(VGA_amd64) || defined(VGA_x86)
+    UInt i = 0;
+    // Legacy prefixes
+    while (i < len && (insn[i] == 0x66 || insn[i] == 0x67 || insn[i] == 0xF0
+            || insn[i] == 0xF2 || insn[i] == 0xF3 || insn[i] == 0x2E
+            || insn[i] == 0x36 || insn[i] == 0x3E || insn[i] == 0x26
+            || insn[i] == 0x64 || insn[i] == 0x65)) {
+        i++;
+    }
+#if defined(VGA_amd64)
+    if (i < len && (insn[i] & 0xF0) == 0x40) {
+        i++; // REX
+    } else if (i + 2 < len && insn[i] == 0xC5) {
+        // Two byte VEX prefix; always the 0F map
+        return insn[i + 2] == 0x2B || insn[i + 2] == 0xE7;
+    } else if (i + 3 < len && insn[i] == 0xC4) {
+        // Three byte VEX prefix
+        return (insn[i + 1] & 0x1F) == 0x01 && (insn[i + 3] == 0x2B || insn[i + 3] == 0xE7);
+    }
+#endif
+    if (i + 1 < len && insn[i] == 0x0F) {
+        UChar op = insn[i + 1];
+        return op == 0x2B || op == 0xC3 || op == 0xE7;
+    }
+#endif
+    return False;
+}
+
+/**
+* \brief Add a write event for a non-temporal store.
+* \param[in,out] sb The IR superblock to which the expression belongs.
+* \param[in] daddr The expression with the address of the operation.
+* \param[in] dsize The size of the operation.
+*/
+static void
+add_nt_store_event(IRSB *sb, IRAtom *daddr, Int dsize)
+{
+    tl_assert(isIRAtom(daddr));
+    tl_assert(dsize >= 1 && dsize < CACHELINE_SIZE);
+
+    IRAtom *guard = NULL;
+    if (pmem.pmat_inline_pmem_check) {
+        guard = make_pmem_guard(sb, daddr, NULL);
+    }
+    IRDirty *di = unsafeIRDirty_0_N(2, "trace_pmem_store_nt", VG_(fnptr_to_fnentry)(trace_pmem_store_nt),
+            mkIRExprVec_2(daddr, mkU64((1ULL << dsize) - 1ULL)));
+    if (guard) {
+        di->guard = guard;
+    }
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
+}
+
+/** Maximum number of stores coalesced into one trace_pmem_store_mask call. */
+#define MAX_STORE_GROUP 64
+/** Store groups open at once, so stores to the stack can interleave with a group. */
+#define MAX_OPEN_STORE_GROUPS 4
+
+/**
+ * Stores of one superblock to constant offsets from the same base temp,
+ * spanning at most a cache line, whose tracing is deferred to a single
+ * trace_pmem_store_mask call.
+ */
+struct pmat_store_group {
+    /** Temp the addresses of the stores are offsets from. */
+    IRTemp base;
+    /** Lowest and one past the highest offset stored to. */
+    Long lo;
+    Long hi;
+    Int num_stores;
+    Long offs[MAX_STORE_GROUP];
+    Int sizes[MAX_STORE_GROUP];
+    /** Whether the stores are non-temporal; never mixed with other stores. */
+    Bool nonTemporal;
+    /** Address of the instruction of the last store. */
+    Addr ip;
+};
+
+struct pmat_store_groups {
+    struct pmat_store_group group[MAX_OPEN_STORE_GROUPS];
+    /** The group to flush next when a store fits none of them. */
+    Int next_victim;
+    /** Address of the current instruction, or 0 once past the last one. */
+    Addr ip;
+    /** Offset of the instruction pointer in the guest state. */
+    Int offset_IP;
+};
+
+/**
+ * For each temp of a superblock, the temp and constant offset its value was
+ * computed from with Add64/Sub64, or itself and 0 otherwise.
+ */
+struct pmat_temp_offsets {
+    IRTemp *base;
+    Long *off;
+    Int num_temps;
+};
+
+static void
+init_temp_offsets(struct pmat_temp_offsets *t, IRTypeEnv *tyenv)
+{
+    t->num_temps = tyenv->types_used;
+    t->base = VG_(malloc)("pmat.temp_offsets.base", VG_MAX(1, t->num_temps) * sizeof(IRTemp));
+    t->off = VG_(malloc)("pmat.temp_offsets.off", VG_MAX(1, t->num_temps) * sizeof(Long));
+    for (Int i = 0; i < t->num_temps; i++) {
+        t->base[i] = i;
+        t->off[i] = 0;
+    }
+}
+
+static void
+free_temp_offsets(struct pmat_temp_offsets *t)
+{
+    VG_(free)(t->base);
+    VG_(free)(t->off);
+}
+
+/** Records 'tmp = base +/- const' so stores through tmp can join a group. */
+static void
+note_temp_offset(struct pmat_temp_offsets *t, IRTemp tmp, IRExpr *e)
+{
+    if (e->tag != Iex_Binop
+            || (e->Iex.Binop.op != Iop_Add64 && e->Iex.Binop.op != Iop_Sub64)
+            || e->Iex.Binop.arg1->tag != Iex_RdTmp
+            || e->Iex.Binop.arg2->tag != Iex_Const
+            || e->Iex.Binop.arg2->Iex.Const.con->tag != Ico_U64) {
+        return;
+    }
+    IRTemp from = e->Iex.Binop.arg1->Iex.RdTmp.tmp;
+    Long c = (Long) e->Iex.Binop.arg2->Iex.Const.con->Ico.U64;
+    t->base[tmp] = t->base[from];
+    t->off[tmp] = t->off[from] + (e->Iex.Binop.op == Iop_Add64 ? c : -c);
+}
+
+/**
+* \brief Whether store groups stay open across a statement.
+*
+* Only plain stores and statements that neither access memory nor leave the
+* superblock keep it open; loads, flushes, fences, helper calls and side
+* exits see every store before them traced.
+*/
+static Bool
+keeps_store_group(IRStmt *st)
+{
+    switch (st->tag) {
+        case Ist_IMark:
+        case Ist_AbiHint:
+        case Ist_Put:
+        case Ist_PutI:
+        case Ist_Store:
+            return True;
+        case Ist_WrTmp:
+            return st->Ist.WrTmp.data->tag != Iex_Load;
+        default:
+            return False;
+    }
+}
+
+/** Emit a single trace_pmem_store_mask or trace_pmem_store_nt for a group. */
+static void
+add_store_mask_event(IRSB *sb, struct pmat_store_group *g)
+{
+    ULong mask = 0;
+    for (Int i = 0; i < g->num_stores; i++) {
+        mask |= ((1ULL << g->sizes[i]) - 1ULL) << (g->offs[i] - g->lo);
+    }
+    IRAtom *start = make_expr(sb, Ity_I64, binop(Iop_Add64, mkexpr(g->base), mkU64((ULong) g->lo)));
+    IRAtom *guard = NULL;
+    if (pmem.pmat_inline_pmem_check) {
+        // A group may start before or end after a registered page
+        IRAtom *last = make_expr(sb, Ity_I64, binop(Iop_Add64, start, mkU64((ULong) (g->hi - g->lo - 1))));
+        IRAtom *first = make_expr(sb, Ity_I32, unop(Iop_1Uto32, make_pmem_guard(sb, start, NULL)));
+        IRAtom *end = make_expr(sb, Ity_I32, unop(Iop_1Uto32, make_pmem_guard(sb, last, NULL)));
+        guard = make_expr(sb, Ity_I1, binop(Iop_CmpNE32,
+                make_expr(sb, Ity_I32, binop(Iop_Or32, first, end)), mkU32(0)));
+    }
+    IRDirty *di;
+    if (g->nonTemporal) {
+        di = unsafeIRDirty_0_N(2, "trace_pmem_store_nt", VG_(fnptr_to_fnentry)(trace_pmem_store_nt),
+                mkIRExprVec_2(start, mkU64(mask)));
+    } else {
+        di = unsafeIRDirty_0_N(2, "trace_pmem_store_mask", VG_(fnptr_to_fnentry)(trace_pmem_store_mask),
+                mkIRExprVec_2(start, mkU64(mask)));
+    }
+    if (guard) {
+        di->guard = guard;
+    }
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
+}
+
+/**
+* \brief Emit the tracing of a store group and empty it.
+*
+* Even a group of one store is traced from memory rather than from its
+* value, since a later store of the superblock through another base temp
+* may have overwritten it by then. If the group is emitted under a later
+* instruction, the instruction pointer is set to that of its last store
+* around the call, so its stack is recorded there.
+*/
+static void
+flush_store_group(IRSB *sb, struct pmat_store_groups *groups, struct pmat_store_group *g)
+{
+    if (g->num_stores == 0) {
+        return;
+    }
+    IRTemp ip = IRTemp_INVALID;
+    if (g->ip != groups->ip) {
+        ip = newIRTemp(sb->tyenv, Ity_I64);
+        addStmtToIRSB(sb, IRStmt_WrTmp(ip, IRExpr_Get(groups->offset_IP, Ity_I64)));
+        addStmtToIRSB(sb, IRStmt_Put(groups->offset_IP, mkU64(g->ip)));
+    }
+    add_store_mask_event(sb, g);
+    if (ip != IRTemp_INVALID) {
+        addStmtToIRSB(sb, IRStmt_Put(groups->offset_IP, mkexpr(ip)));
+    }
+    g->num_stores = 0;
+}
+
+static void
+flush_store_groups(IRSB *sb, struct pmat_store_groups *groups)
+{
+    for (Int i = 0; i < MAX_OPEN_STORE_GROUPS; i++) {
+        flush_store_group(sb, groups, &groups->group[i]);
+    }
+}
+
+/**
+* \brief Add a plain store to an open group, or trace it on its own.
+*
+* Stores of integer, floating point or vector values through a temp join the open
+* group off the same base temp, if the group still spans at most a cache
+* line afterwards; otherwise that group is flushed and the store starts a
+* new one, as it does when no group is off its base. Non-temporal stores
+* only group with each other.
+* \param[in,out] sb The IR superblock to which the expression belongs.
+* \param[in,out] groups The open store groups.
+* \param[in] t The base and offset of each temp.
+* \param[in] daddr The expression with the address of the store.
+* \param[in] dsize The size of the store.
+* \param[in] value The expression with the value of the store.
+* \param[in] nonTemporal Whether the store is non-temporal.
+*/
+static void
+add_store_group(IRSB *sb, struct pmat_store_groups *groups, struct pmat_temp_offsets *t,
+        IRAtom *daddr, Int dsize, IRAtom *value, Bool nonTemporal)
+{
+    // Non-temporal stores bypass the cache, so keep them in order with the others
+    for (Int i = 0; i < MAX_OPEN_STORE_GROUPS; i++) {
+        if (groups->group[i].nonTemporal != nonTemporal) {
+            flush_store_group(sb, groups, &groups->group[i]);
+        }
+    }
+    IRType type = typeOfIRExpr(sb->tyenv, value);
+    if (daddr->tag != Iex_RdTmp || (dsize > 8 && type != Ity_V128 && type != Ity_V256)) {
+        // Traced right away, so after every store before it
+        flush_store_groups(sb, groups);
+        if (nonTemporal) {
+            add_nt_store_event(sb, daddr, dsize);
+        } else {
+            add_event_dw(sb, daddr, dsize, value);
+        }
+        return;
+    }
+
+    IRTemp tmp = daddr->Iex.RdTmp.tmp;
+    IRTemp base = t->base[tmp];
+    Long off = t->off[tmp];
+    struct pmat_store_group *g = NULL;
+    struct pmat_store_group *empty = NULL;
+    for (Int i = 0; i < MAX_OPEN_STORE_GROUPS; i++) {
+        struct pmat_store_group *cur = &groups->group[i];
+        if (cur->num_stores == 0) {
+            empty = empty ? empty : cur;
+        } else if (cur->base == base) {
+            g = cur;
+        }
+    }
+    if (g) {
+        Long lo = VG_MIN(g->lo, off);
+        Long hi = VG_MAX(g->hi, off + dsize);
+        if (hi - lo > CACHELINE_SIZE || g->num_stores == MAX_STORE_GROUP) {
+            flush_store_group(sb, groups, g);
+        }
+    } else if (empty) {
+        g = empty;
+    } else {
+        g = &groups->group[groups->next_victim];
+        groups->next_victim = (groups->next_victim + 1) % MAX_OPEN_STORE_GROUPS;
+        flush_store_group(sb, groups, g);
+    }
+    if (g->num_stores == 0) {
+        g->base = base;
+        g->lo = off;
+        g->hi = off + dsize;
+        g->nonTemporal = nonTemporal;
+    }
+    g->lo = VG_MIN(g->lo, off);
+    g->hi = VG_MAX(g->hi, off + dsize);
+    g->offs[g->num_stores] = off;
+    g->sizes[g->num_stores] = dsize;
+    g->num_stores++;
+    g->ip = groups->ip;
+}
+
+
+/**
+* \brief Removes an entry from the write-back buffer and writes it back.
+*/
+static void
+drain_wb_entry(struct pmat_writeback_buffer_entry *wbentry)
+{
+    wb_queue_unlink(wbentry);
+    VG_(OSetGen_Remove)(pmem.pmat_writeback_buffer_entries, wbentry);
+    write_to_file(wbentry);
+    free_cache_entry(wbentry->entry);
+    VG_(OSetGen_FreeNode)(pmem.pmat_writeback_buffer_entries, wbentry);
+}
 
 static void
 _do_fence(void)
 {   
+    struct pmat_thread_state *ts = current_thread_state();
+    ++ts->fences;
+    // Combined non-temporal stores are ordered by the fence like flushes
+    drain_wc_buffer(ts);
     if (VG_(OSetGen_Size)(pmem.pmat_writeback_buffer_entries) == 0) {
         return;
     }
     ThreadId tid = VG_(get_running_tid)();
-    XArray *arr = VG_(newXA)(VG_(malloc), "pmat_wb_fence", VG_(free), sizeof(struct pmat_writeback_buffer_entry));  
-    VG_(OSetGen_ResetIter)(pmem.pmat_writeback_buffer_entries);
+    struct pmat_wb_queue *queue = get_wb_queue(tid);
     struct pmat_writeback_buffer_entry *wbentry;
-    while ( (wbentry = VG_(OSetGen_Next)(pmem.pmat_writeback_buffer_entries)) ) {
-        if (wbentry->tid == tid) {
-            VG_(addToXA)(arr, &wbentry); 
-        }
-    }
-    Word nEntries = VG_(sizeXA)(arr);
-    //VG_(emit)("Fencing %u entries for tid %lu\n", nEntries, tid);
-    for (int i = 0; i < nEntries; i++) {
-        wbentry = *(struct pmat_writeback_buffer_entry **) VG_(indexXA)(arr, i);
-        VG_(OSetGen_Remove)(pmem.pmat_writeback_buffer_entries, wbentry);
-        write_to_file(wbentry);
-        VG_(free)(wbentry->entry);
-        VG_(OSetGen_FreeNode)(pmem.pmat_writeback_buffer_entries, wbentry);
+    while ( (wbentry = queue->head) ) {
+        drain_wb_entry(wbentry);
     }
-    VG_(deleteXA)(arr);
 }
 
 /**
@@ -1323,7 +2768,7 @@ do_fence(void)
     _do_fence();
 }
 
-static void do_writeback(struct pmat_cache_entry *entry, Bool explicit) {    
+static void do_writeback(struct pmat_cache_entry *entry, Bool explicit) {
     eviction_remove(TRIM_CACHELINE(entry->addr));
     ThreadId tid;
     // Flush was initiated by current thread...
@@ -1333,35 +2778,29 @@ static void do_writeback(struct pmat_cache_entry *entry, Bool explicit) {
         // Was evicted; only a `fence` from original thread that last stored matters
         tid = entry->tid;
     }
-    struct pmat_registered_file file = {0};
-    file.addr = entry->addr; 
-    struct pmat_registered_file *realFile = VG_(OSetGen_LookupWithCmp)(pmem.pmat_registered_files, &file, (OSetCmp_t) find_file_by_addr);
-    // TODO: May want to move this behind some compile-time preprocessor directive
-    if (!realFile) {
-        VG_(emit)("Could not find descriptor for 0x%lx\n", file.addr);
-        VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
-        struct pmat_registered_file *tmp;
-        while ((tmp = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
-            VG_(emit)("File Found: (%lx, 0x%lx, 0x%lx)\n", tmp->descr, tmp->addr, tmp->size);
-        }
-    }
-    tl_assert(realFile && "Unable to find descriptor associated with an address!");
-    //VG_(emit)("Parent-Flush: (0x%lx, 0x%lx)\n", realFile->descr, entry->addr);
+    writeback_entry(entry, tid, explicit ? record_stack(NULL) : NULL);
+}
+
+/**
+* \brief Write back a line that is no longer cached.
+*
+* Lines flushed at 'locOfFlush' wait in the write-back buffer for a fence
+* from 'tid'; evicted lines (NULL) are written back immediately.
+*/
+static void writeback_entry(struct pmat_cache_entry *entry, ThreadId tid, ExeContext *locOfFlush) {
+    //VG_(emit)("Parent-Flush: (0x%lx, 0x%lx)\n", entry->file->descr, entry->addr);
     
     // See if this entry already exists
     struct pmat_writeback_buffer_entry wblookup;
     wblookup.entry = entry;
     struct pmat_writeback_buffer_entry *exist = VG_(OSetGen_Lookup)(pmem.pmat_writeback_buffer_entries, &wblookup);
     if (exist) {
-       VG_(OSetGen_Remove)(pmem.pmat_writeback_buffer_entries, exist);
-       write_to_file(exist);
-       VG_(free)(exist->entry);
-       VG_(OSetGen_FreeNode)(pmem.pmat_writeback_buffer_entries, exist);
+       drain_wb_entry(exist);
     }
 
-    if (!explicit) {
+    if (!locOfFlush) {
         write_to_file(&wblookup);
-        VG_(free)(entry);
+        free_cache_entry(entry);
         return;
     }
 
@@ -1369,30 +2808,16 @@ static void do_writeback(struct pmat_cache_entry *entry, Bool explicit) {
     struct pmat_writeback_buffer_entry *wbentry = VG_(OSetGen_AllocNode)(pmem.pmat_writeback_buffer_entries, (SizeT) sizeof(struct pmat_writeback_buffer_entry));
     wbentry->entry = entry;
     wbentry->tid = tid;
-    if (explicit) {
-        wbentry->locOfFlush = VG_(record_ExeContext)(VG_(get_running_tid)(), 0);
-    } else {
-        wbentry->locOfFlush = NULL;
-    }
+    wbentry->locOfFlush = locOfFlush;
     VG_(OSetGen_Insert)(pmem.pmat_writeback_buffer_entries, wbentry);
+    wb_queue_push(wbentry);
     if (VG_(OSetGen_Size)(pmem.pmat_writeback_buffer_entries) > pmem.pmat_num_wb_entries) {
-        XArray *arr = VG_(newXA)(VG_(malloc), "pmat_wb_eviction", VG_(free), sizeof(struct pmat_writeback_buffer_entry));  
-        VG_(OSetGen_ResetIter)(pmem.pmat_writeback_buffer_entries);
-        struct pmat_writeback_buffer_entry *tmp;
-        while ( (tmp = VG_(OSetGen_Next)(pmem.pmat_writeback_buffer_entries)) ) {
-            if (should_crash) {
-                VG_(addToXA)(arr, &tmp); 
+        // Buffer is full; drain the queues of every thread
+        for (UInt i = 0; i < pmem.pmat_num_wb_queues; i++) {
+            while ( (wbentry = pmem.pmat_wb_queues[i].head) ) {
+                drain_wb_entry(wbentry);
             }
         }
-        Word nEntries = VG_(sizeXA)(arr);
-        for (int i = 0; i < nEntries; i++) {
-            wbentry = *(struct pmat_writeback_buffer_entry **) VG_(indexXA)(arr, i);
-            VG_(OSetGen_Remove)(pmem.pmat_writeback_buffer_entries, wbentry);
-            write_to_file(wbentry);
-            VG_(free)(wbentry->entry);
-            VG_(OSetGen_FreeNode)(pmem.pmat_writeback_buffer_entries, wbentry);
-        }
-        VG_(deleteXA)(arr);
     }
 }
 
@@ -1403,15 +2828,22 @@ static void do_writeback(struct pmat_cache_entry *entry, Bool explicit) {
 * DIRTY->FLUSHED->FENCED->COMMITTED->CLEAN. The CLEAN state is not registered,
 * the store is removed from the set.
 *
+* Every cache line overlapping [base, base + size) is flushed.
+*
 * \param[in] base The base address of the flush.
 * \param[in] size The size of the flush in bytes.
 */
 static void
 do_flush(UWord base, UWord size) {
-    // If the cache line has not been written back, write it into that cache-line.
-    struct pmat_cache_entry *exists = eviction_lookup(TRIM_CACHELINE(base));
-    if (exists) {
-        do_writeback(exists, True);
+    ++current_thread_state()->flushes;
+    Addr last = TRIM_CACHELINE(base + (size ? size - 1 : 0));
+    // Stop early once nothing is left in the cache
+    for (Addr line = TRIM_CACHELINE(base); line <= last && eviction_size() != 0; line += CACHELINE_SIZE) {
+        // If the cache line has not been written back, write it into that cache-line.
+        struct pmat_cache_entry *exists = eviction_lookup(line);
+        if (exists) {
+            do_writeback(exists, True);
+        }
     }
 }
 
@@ -1589,17 +3021,49 @@ pmat_instrument(VgCallbackClosure *closure,
     }
 
     /* Count this superblock. */
-    IRDirty *di = unsafeIRDirty_0_N( 0, "add_one_SB_entered",
-            VG_(fnptr_to_fnentry)(&add_one_SB_entered), mkIRExprVec_0());
-    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+    add_sb_counter(sbOut);
+
+    /* Nothing to track until a region is registered */
+    if (!pmem.pmat_instrumenting) {
+        for (/*use current i*/; i < bb->stmts_used; i++) {
+            addStmtToIRSB(sbOut, bb->stmts[i]);
+        }
+        return sbOut;
+    }
+
+    struct pmat_store_groups groups;
+    for (Int j = 0; j < MAX_OPEN_STORE_GROUPS; j++) {
+        groups.group[j].num_stores = 0;
+        groups.group[j].nonTemporal = False;
+    }
+    groups.next_victim = 0;
+    groups.ip = 0;
+    groups.offset_IP = layout->offset_IP;
+    struct pmat_temp_offsets offsets;
+    init_temp_offsets(&offsets, tyenv);
+    // Whether the current instruction is a non-temporal store
+    Bool nonTemporal = False;
 
     for (/*use current i*/; i < bb->stmts_used; i++) {
         IRStmt *st = bb->stmts[i];
         if (!st || st->tag == Ist_NoOp)
             continue;
 
+        if (!keeps_store_group(st)) {
+            flush_store_groups(sbOut, &groups);
+        }
+        if (st->tag == Ist_WrTmp) {
+            note_temp_offset(&offsets, st->Ist.WrTmp.tmp, st->Ist.WrTmp.data);
+        }
+
         switch (st->tag) {
             case Ist_IMark:
+                nonTemporal = pmem.pmat_non_temporal_stores
+                        && is_non_temporal_store((const UChar *) (Addr) st->Ist.IMark.addr, st->Ist.IMark.len);
+                groups.ip = st->Ist.IMark.addr + st->Ist.IMark.delta;
+                addStmtToIRSB(sbOut, st);
+                break;
+
             case Ist_AbiHint:
             case Ist_Put:
             case Ist_PutI:
@@ -1635,21 +3099,30 @@ pmat_instrument(VgCallbackClosure *closure,
             }
 
             case Ist_Store: {
-                addStmtToIRSB(sbOut, st);
                 IRExpr *data = st->Ist.Store.data;
                 IRType type = typeOfIRExpr(tyenv, data);
                 tl_assert(type != Ity_INVALID);
-                add_event_dw(sbOut, st->Ist.Store.addr, sizeofIRType(type),
-                        data);
+                add_materialize_check(sbOut, st->Ist.Store.addr, sizeofIRType(type));
+                addStmtToIRSB(sbOut, st);
+                if (pmem.pmat_coalesce_stores) {
+                    add_store_group(sbOut, &groups, &offsets, st->Ist.Store.addr,
+                            sizeofIRType(type), data, nonTemporal);
+                } else if (nonTemporal) {
+                    add_nt_store_event(sbOut, st->Ist.Store.addr, sizeofIRType(type));
+                } else {
+                    add_event_dw(sbOut, st->Ist.Store.addr, sizeofIRType(type),
+                            data);
+                }
                 break;
             }
 
             case Ist_StoreG: {
-                addStmtToIRSB(sbOut, st);
                 IRStoreG *sg = st->Ist.StoreG.details;
                 IRExpr *data = sg->data;
                 IRType type = typeOfIRExpr(tyenv, data);
                 tl_assert(type != Ity_INVALID);
+                add_materialize_check(sbOut, sg->addr, sizeofIRType(type));
+                addStmtToIRSB(sbOut, st);
                 add_event_dw_guarded(sbOut, sg->addr, sizeofIRType(type),
                         sg->guard, data);
                 break;
@@ -1663,6 +3136,7 @@ pmat_instrument(VgCallbackClosure *closure,
                 tl_assert(cas->dataLo != NULL);
                 dataTy = typeOfIRExpr(tyenv, cas->dataLo);
                 dataSize = sizeofIRType(dataTy);
+                add_materialize_check(sbOut, cas->addr, cas->dataHi ? 2 * dataSize : dataSize);
                 /* has to be done before registering the guard */
                 addStmtToIRSB(sbOut, st);
                 // CAS has a LOCK prefix on it that acts as a memory fence
@@ -1723,6 +3197,10 @@ pmat_instrument(VgCallbackClosure *closure,
             }
 
             case Ist_LLSC: {
+                if (st->Ist.LLSC.storedata != NULL) {
+                    add_materialize_check(sbOut, st->Ist.LLSC.addr,
+                            sizeofIRType(typeOfIRExpr(tyenv, st->Ist.LLSC.storedata)));
+                }
                 addStmtToIRSB(sbOut, st);
                 IRType dataTy;
                 if (st->Ist.LLSC.storedata != NULL) {
@@ -1738,10 +3216,124 @@ pmat_instrument(VgCallbackClosure *closure,
                 tl_assert(0);
         }
     }
+    // The instruction pointer has been set to the next superblock by now
+    groups.ip = 0;
+    flush_store_groups(sbOut, &groups);
+    free_temp_offsets(&offsets);
 
     return sbOut;
 }
 
+/**
+* \brief Switch instrumentation on or off with --lazy-instrumentation.
+*
+* Code is only instrumented while a region is registered. When the first
+* region is registered or the last one unregistered, every translation is
+* discarded so that code is translated again with or without instrumentation.
+* Must be called from a client request, where translations may be discarded.
+*/
+static void
+update_instrumentation(void)
+{
+    Bool instrumenting = VG_(OSetGen_Size)(pmem.pmat_registered_files) > 0;
+    if (!pmem.pmat_lazy_instrumentation || instrumenting == pmem.pmat_instrumenting) {
+        return;
+    }
+    pmem.pmat_instrumenting = instrumenting;
+    VG_(discard_translations_safely)((Addr) 0, ~(SizeT) 0, "pmat.update_instrumentation");
+}
+
+/**
+* \brief Bytes of a pending line that have been stored to but not written back.
+*
+* Looks the line up in the cache, then the write-back buffer, and only
+* searches the write-combining buffers if the line has copies left over.
+* None of the lookups change which line is evicted next.
+*/
+static ULong
+unpersisted_bytes(struct pmat_registered_file *file, Addr line)
+{
+    UShort left = *pending_count(file, line);
+    ULong mask = 0;
+    struct pmat_cache_entry *cached = eviction_peek(line);
+    if (cached) {
+        mask |= cached->dirtyBits;
+        left--;
+    }
+    struct pmat_cache_entry key = { .addr = line };
+    struct pmat_writeback_buffer_entry wblookup = { .entry = &key };
+    struct pmat_writeback_buffer_entry *flushed = VG_(OSetGen_Lookup)(pmem.pmat_writeback_buffer_entries, &wblookup);
+    if (flushed) {
+        mask |= flushed->entry->dirtyBits;
+        left--;
+    }
+    for (ThreadId tid = 1; tid < VG_N_THREADS && left > 0; tid++) {
+        struct pmat_thread_state *ts = VG_(get_tool_thread_data)(tid);
+        Int i = ts ? find_wc_entry(ts, line) : -1;
+        if (i >= 0) {
+            mask |= ts->wc[i]->dirtyBits;
+            left--;
+        }
+    }
+    return mask;
+}
+
+/**
+* \brief Whether every store to [addr, addr + size) has been written back.
+*
+* Reads the pending count of each cache line in the range once. Only pending
+* lines that the range covers in part, at most one at either end, are looked
+* up to see which of their bytes are pending. Bytes outside of registered
+* regions are never pending.
+*/
+static Bool
+is_persisted(Addr addr, SizeT size)
+{
+    Addr end = addr + size;
+    while (addr < end) {
+        struct pmat_registered_file key = {0};
+        key.addr = addr;
+        struct pmat_registered_file *file = VG_(OSetGen_LookupWithCmp)(pmem.pmat_registered_files, &key, (OSetCmp_t) find_file_by_addr);
+        if (!file) {
+            addr = TRIM_CACHELINE(addr) + CACHELINE_SIZE;
+            continue;
+        }
+        Addr stop = VG_MIN(end, file->addr + file->size);
+        for (Addr line = TRIM_CACHELINE(addr); line < stop; line += CACHELINE_SIZE) {
+            if (*pending_count(file, line) == 0) {
+                continue;
+            }
+            Addr lo = VG_MAX(addr, line);
+            Addr hi = VG_MIN(stop, line + CACHELINE_SIZE);
+            if (hi - lo == CACHELINE_SIZE) {
+                return False;
+            }
+            ULong range = ((1ULL << (hi - lo)) - 1ULL) << (lo - line);
+            if (unpersisted_bytes(file, line) & range) {
+                return False;
+            }
+        }
+        addr = stop;
+    }
+    return True;
+}
+
+/**
+* \brief Stop tracking a registered file.
+*
+* The node is not freed: cache and write-back buffer entries hold a pointer to
+* it and still write back into its shadow mapping, which is never unmapped.
+*/
+static void
+unregister_file(struct pmat_registered_file *file)
+{
+    fill_unmaterialized(file);
+    sync_shadow_file(file);
+    VG_(OSetGen_Remove)(pmem.pmat_registered_files, file);
+    pmat_shadow_set_range(file->addr, file->size, PMAT_SHADOW_NONE);
+    update_instrumentation();
+}
+
 /**
 * \brief Client mechanism handler.
 * \param[in] tid Id of the calling thread.
@@ -1770,6 +3362,7 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             && VG_USERREQ__PMC_PMAT_SCHEDULER_STOP != arg[0]
             && VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED != arg[0]
             && VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED_TOTAL != arg[0]
+            && VG_USERREQ__PMC_PMAT_THREAD_STATS != arg[0]
             && VG_USERREQ__PMC_RESERVED1 != arg[0]
             && VG_USERREQ__PMC_RESERVED2 != arg[0]
             && VG_USERREQ__PMC_RESERVED3 != arg[0]
@@ -1783,8 +3376,21 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
 
     switch (arg[0]) {
         case VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED: {
-            tl_assert2(VG_(get_running_tid)() < 1024, "More than 1024 threads! tid=%d", VG_(get_running_tid)());
-            *ret = threadSBlocks[VG_(get_running_tid)()];
+            *ret = current_thread_state()->sblocks;
+            break;
+        }
+        case VG_USERREQ__PMC_PMAT_THREAD_STATS: {
+            struct pmat_thread_state *ts = current_thread_state();
+            pmat_thread_stats *stats = (pmat_thread_stats *) arg[1];
+            if (stats == NULL) {
+                *ret = -1;
+                break;
+            }
+            stats->superblocks = ts->sblocks;
+            stats->stores = ts->stores;
+            stats->flushes = ts->flushes;
+            stats->fences = ts->fences;
+            *ret = 0;
             break;
         }
         case VG_USERREQ__PMC_PMAT_SUPERBLOCKS_EXECUTED_TOTAL: {
@@ -1792,13 +3398,11 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             break;
         }
         case VG_USERREQ__PMC_PMAT_SCHEDULER_START: {
-            tl_assert2(VG_(get_running_tid)() < 1024, "More than 1024 threads! tid=%d", VG_(get_running_tid)());
-            VG_(code_of_interest)[VG_(get_running_tid)()] = True;
+            VG_(set_code_of_interest)(VG_(get_running_tid)(), True);
             break;
         }
         case VG_USERREQ__PMC_PMAT_SCHEDULER_STOP: {
-            tl_assert2(VG_(get_running_tid)() < 1024, "More than 1024 threads! tid=%d", VG_(get_running_tid)());
-            VG_(code_of_interest)[VG_(get_running_tid)()] = False;       
+            VG_(set_code_of_interest)(VG_(get_running_tid)(), False);
             break;
         }
         case VG_USERREQ__PMC_PMAT_PERSIST_ORDER: {
@@ -1806,11 +3410,8 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             break;
         }
         // Check both simulated CPU Cache and whether or not write-back reordering buffer contains cache-line(s) for [addr, addr + sz)
-        // TODO: Handle cases where we cross multiple cache-lines
         case VG_USERREQ__PMC_PMAT_IS_PERSIST: {
-            VG_(emit)("PMAT_IS_PERSIST is not implemented!");
-            int *retaddr = arg[3];
-            *retaddr = -1;
+            *ret = is_persisted(arg[1], arg[2]);
             break;
         }
         // Add to table of addresses to ignore.
@@ -1832,6 +3433,9 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             // Check if exists...
             if (!VG_(OSetGen_Contains)(pmem.pmat_transient_addresses, entry)) {
                 VG_(OSetGen_Insert)(pmem.pmat_transient_addresses, entry);
+                // CHECK pages are no longer materialized on demand
+                materialize_range(entry->addr, entry->size);
+                pmat_shadow_mark_check(entry->addr, entry->size);
             }
             break;
         }
@@ -1861,9 +3465,7 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             }
             
             // Create copy of 'name' in case user passes in non-constant heap-allocated data
-            HChar *name = VG_(malloc)("File Name Copy", VG_(strlen)(_name));
-            tl_assert(name);
-            VG_(strcpy)(name, _name);
+            HChar *name = VG_(strdup)("File Name Copy", _name);
             struct pmat_registered_file *file = VG_(OSetGen_AllocNode)(pmem.pmat_registered_files, (SizeT) sizeof(struct pmat_registered_file));
             tl_assert(file);
             file->addr = addr;
@@ -1871,13 +3473,10 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             file->name = name;
             if (arg[0] == VG_USERREQ__PMC_PMAT_REGISTER_WITH_FN) {
                 file->verify_fn = arg[4];
+            } else {
+                file->verify_fn = NULL;
             }
-            SysRes res = VG_(open)(file->name, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_RDWR, 0666);
-            if (sr_isError(res)) {
-                VG_(emit)("Could not open file '%s'; errno: %ld\n", file->name, sr_Err(res));
-                tl_assert(0);
-            }
-            file->descr = sr_Res(res);
+            create_shadow_file(file);
             VG_(ftruncate)(file->descr, file->size);
             tl_assert(file->descr != (UWord) -1);
 
@@ -1885,10 +3484,35 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
             // that we have thread serialization thanks to Valgrind, we know
             // that the heap cannot be modified while we are making this copy.
             VG_(OSetGen_Insert)(pmem.pmat_registered_files, file);
-            addr = VG_(mmap)((Addr) NULL, file->size, VKI_PROT_READ | VKI_PROT_WRITE,  VKI_MAP_SHARED, file->descr, 0);
+            update_instrumentation();
+            addr = VG_(mmap)((Addr) NULL, file->size, VKI_PROT_READ | VKI_PROT_WRITE,  verify_async() ? VKI_MAP_PRIVATE : VKI_MAP_SHARED, file->descr, 0);
             tl_assert2(addr != ((Addr) -1), "MMAP failed!");
-            VG_(memcpy)((void *) addr, (void *) file->addr, file->size);
             file->mmap_addr = addr;
+            if (pmem.pmat_lazy_shadow) {
+                // Pages are copied by materialize_page before they are first stored to
+                file->materialized = VG_(calloc)("pmat.materialized", (file_num_pages(file) + 7) / 8, 1);
+            } else {
+                VG_(memcpy)((void *) addr, (void *) file->addr, file->size);
+                file->materialized = NULL;
+            }
+            file->pending = VG_(calloc)("pmat.pending", (file->size + CACHELINE_SIZE - 1) / CACHELINE_SIZE, sizeof(UShort));
+            if (pmem.pmat_dedup_verifications) {
+                hash_file(file);
+            }
+
+            // Mark region in shadow map; pages with transient ranges take the slow path.
+            pmat_shadow_set_range(file->addr, file->size, pmem.pmat_lazy_shadow ? PMAT_SHADOW_LAZY : PMAT_SHADOW_PMEM);
+            if (pmem.pmat_lazy_shadow) {
+                // Partial pages at either end are CHECK, so they are not materialized on demand
+                materialize_page(file, 0);
+                materialize_page(file, file_num_pages(file) - 1);
+            }
+            VG_(OSetGen_ResetIter)(pmem.pmat_transient_addresses);
+            struct pmat_transient_entry *trans;
+            while ((trans = VG_(OSetGen_Next)(pmem.pmat_transient_addresses))) {
+                materialize_range(trans->addr, trans->size);
+                pmat_shadow_mark_check(trans->addr, trans->size);
+            }
             break;
         }
         case VG_USERREQ__PMC_PMAT_UNREGISTER_BY_ADDR: {
@@ -1899,8 +3523,7 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
                 if (!found) {
                     break;
                 }
-                VG_(OSetGen_Remove)(pmem.pmat_registered_files, found);
-                VG_(OSetGen_FreeNode)(pmem.pmat_registered_files, found);
+                unregister_file(found);
             }
             break;
         }
@@ -1912,8 +3535,7 @@ pmat_handle_client_request(ThreadId tid, UWord *arg, UWord *ret )
                 if (!found) {
                     break;
                 }
-                VG_(OSetGen_Remove)(pmem.pmat_registered_files, found);
-                VG_(OSetGen_FreeNode)(pmem.pmat_registered_files, found);
+                unregister_file(found);
             }
             break;
         }
@@ -1989,7 +3611,24 @@ pmat_process_cmd_line_option(const HChar *arg)
     else if VG_BOOL_CLO(arg, "--preserve-bin-on-error", pmem.pmat_preserve_bin_on_error) {}
     else if VG_BOOL_CLO(arg, "--aggregate-dump-only", pmem.pmat_aggregate_dump_only) {}
     else if VG_BOOL_CLO(arg, "--terminate-on-error", pmem.pmat_terminate_on_error) {}
+    else if VG_BOOL_CLO(arg, "--inline-pmem-check", pmem.pmat_inline_pmem_check) {}
+    else if VG_BOOL_CLO(arg, "--coalesce-stores", pmem.pmat_coalesce_stores) {}
+    else if VG_BOOL_CLO(arg, "--non-temporal-stores", pmem.pmat_non_temporal_stores) {}
+    else if VG_BOOL_CLO(arg, "--in-process-verification", pmem.pmat_in_process_verification) {}
+    else if VG_BINT_CLO(arg, "--verifier-jobs", pmem.pmat_verifier_jobs, 0, 1024) {}
+    else if VG_BINT_CLO(arg, "--verifier-timeout", pmem.pmat_verifier_timeout, 0, 1000 * 60 * 60 * 24) {}
+    else if VG_STR_CLO(arg, "--record-crashes", pmem.pmat_record_file) {}
+    else if VG_BOOL_CLO(arg, "--dedup-verifications", pmem.pmat_dedup_verifications) {}
+    else if VG_BOOL_CLO(arg, "--lazy-shadow", pmem.pmat_lazy_shadow) {}
+    else if VG_BOOL_CLO(arg, "--lazy-instrumentation", pmem.pmat_lazy_instrumentation) {}
+    else if VG_STR_CLO(arg, "--shadow-dir", pmem.pmat_shadow_dir) {}
+    else if VG_BOOL_CLO(arg, "--shadow-memfd", pmem.pmat_shadow_memfd) {}
+    else if VG_STR_CLO(arg, "--replay-crashes", pmem.pmat_replay_file) {}
+    else if VG_INT_CLO(arg, "--replay-crash", pmem.pmat_replay_crash) {}
     else if VG_STR_CLO(arg, "--eviction-policy", pmem.pmat_eviction_policy_str) {}
+    else if VG_STR_CLO(arg, "--store-stack-mode", pmem.pmat_store_stack_mode_str) {}
+    else if VG_BINT_CLO(arg, "--store-stack-depth", pmem.pmat_store_stack_depth, 0, PMAT_MAX_STACK_DEPTH) {}
+    else if VG_DBL_CLO(arg, "--store-stack-probability", pmem.pmat_store_stack_prob) {}
     else if VG_INT_CLO(arg, "--scheduling-quantum", VG_(scheduling_quantum)) {}
     else if VG_BOOL_CLO(arg, "--randomize-quantum", VG_(randomize_quantum)) {}
     else if VG_BOOL_CLO(arg, "--handle-code-of-interest", VG_(handle_code_of_interest)) {}
@@ -2005,16 +3644,39 @@ pmat_process_cmd_line_option(const HChar *arg)
 static void
 pmat_post_clo_init(void)
 {
+    if (pmem.pmat_store_stack_prob < 0 || pmem.pmat_store_stack_prob > 1) {
+        VG_(fmsg_bad_option)("--store-stack-probability", "%f is not a probability in [0, 1]\n", pmem.pmat_store_stack_prob);
+    }
     pmem.pmat_writeback_buffer_entries = VG_(OSetGen_Create_With_Pool)(0, cmp_pmat_write_buffer_entries, VG_(malloc), "pmat.main.cpci.-2", VG_(free),
             MAX(100, pmem.pmat_num_wb_entries), (SizeT) sizeof(struct pmat_writeback_buffer_entry));
+    // Entries live in the cache and then in the write-back buffer until fenced
+    pmem.pmat_cache_entry_arena = pmat_arena_create("pmat.new_entry", sizeof(struct pmat_cache_entry) + CACHELINE_SIZE,
+            pmem.pmat_num_cache_entries + pmem.pmat_num_wb_entries + 1);
     pmem.pmat_transient_addresses = VG_(OSetGen_Create)(0, cmp_pmat_transient_entries, VG_(malloc), "pmi.main.cpci.-3", VG_(free));
     if (pmem.pmat_aggregate_dump_only) {
         pmem.pmat_aggregate_cache_dump = VG_(OSetGen_Create)(0, cmp_exe_context_pointers, VG_(malloc), "pmat.main.cpci.-4", VG_(free));
         pmem.pmat_aggregate_flushed_dump = VG_(OSetGen_Create)(0, cmp_flush_locations, VG_(malloc), "pmat.main.cpci.-5", VG_(free));
     }
     pmem.pmat_should_verify = True;
+    pmem.pmat_instrumenting = !pmem.pmat_lazy_instrumentation;
+    if (pmem.pmat_replay_file) {
+        open_replay_file();
+    }
+    // Seed before anything (including the eviction policy) draws random numbers
+    pmat_rng_init(pmem.pmat_rng_seed);
+    if (pmem.pmat_record_file) {
+        create_record_file();
+    }
+    VG_(quantum_seed) = pmat_random(PMAT_RNG_SCHEDULE);
+    if (pmem.pmat_verifier_jobs == 0) {
+        pmem.pmat_verifier_jobs = VG_MAX(get_num_procs(), 1);
+    }
+    pmem.pmat_running_jobs = VG_(malloc)("pmat.main.cpci.-6", pmem.pmat_verifier_jobs * sizeof(struct pmat_verifier_job));
+    pmem.pmat_num_running_jobs = 0;
+    pmat_shadow_init();
     // Parent compares based on 'Addr' so that it can find the descr associated with the address.
     pmem.pmat_registered_files = VG_(OSetGen_Create)(0, cmp_pmat_registered_files1, VG_(malloc), "pmat.main.cpci.-1", VG_(free));
+    pmem.pmat_verified_states = VG_(HT_construct)("pmat.main.cpci.verified_states");
     VG_(emit)(
         "Verifier = %s\n"
         "Eviction Rate = %.0f%%\n"
@@ -2037,23 +3699,47 @@ pmat_post_clo_init(void)
     );
 
     if (VG_(strncasecmp)(pmem.pmat_eviction_policy_str, "RR", 2) == 0) {
-        pmem.pmat_eviction_policy.arg = pmat_create_rr();
+        pmem.pmat_eviction_policy.arg = pmat_create_rr(pmem.pmat_num_cache_entries + 1);
         pmem.pmat_eviction_policy.insert = pmat_rr_cache_insert;
         pmem.pmat_eviction_policy.remove = pmat_rr_cache_remove;
         pmem.pmat_eviction_policy.evict = pmat_rr_cache_evict;
         pmem.pmat_eviction_policy.lookup = pmat_rr_cache_lookup;
+        pmem.pmat_eviction_policy.peek = pmat_rr_cache_lookup;
         pmem.pmat_eviction_policy.size = pmat_rr_cache_size;
         pmem.pmat_eviction_policy.to_array = pmat_rr_cache_to_array;
+    } else if (VG_(strncasecmp)(pmem.pmat_eviction_policy_str, "FLAT", 4) == 0) {
+        pmem.pmat_eviction_policy.arg = pmat_create_flat(pmem.pmat_num_cache_entries + 1);
+        pmem.pmat_eviction_policy.insert = (void *) pmat_flat_cache_insert;
+        pmem.pmat_eviction_policy.remove = (void *) pmat_flat_cache_remove;
+        pmem.pmat_eviction_policy.evict = (void *) pmat_flat_cache_evict;
+        pmem.pmat_eviction_policy.lookup = (void *) pmat_flat_cache_lookup;
+        pmem.pmat_eviction_policy.peek = (void *) pmat_flat_cache_lookup;
+        pmem.pmat_eviction_policy.size = (void *) pmat_flat_cache_size;
+        pmem.pmat_eviction_policy.to_array = (void *) pmat_flat_cache_to_array;
     } else if (VG_(strncasecmp)(pmem.pmat_eviction_policy_str, "LRU", 3) == 0) {
-        pmem.pmat_eviction_policy.arg = pmat_create_lru();
+        pmem.pmat_eviction_policy.arg = pmat_create_lru(pmem.pmat_num_cache_entries + 1);
         pmem.pmat_eviction_policy.insert = pmat_lru_cache_insert;
         pmem.pmat_eviction_policy.remove = pmat_lru_cache_remove;
         pmem.pmat_eviction_policy.evict = pmat_lru_cache_evict;
         pmem.pmat_eviction_policy.lookup = pmat_lru_cache_lookup;
+        pmem.pmat_eviction_policy.peek = pmat_lru_cache_peek;
         pmem.pmat_eviction_policy.size = pmat_lru_cache_size;
         pmem.pmat_eviction_policy.to_array = pmat_lru_cache_to_array;
     } else {
-        VG_(emit)("[ERROR] Bad eviction policy provided: '%s'; Require 'RR' or 'LRU' (not case sensitive)!\n", pmem.pmat_eviction_policy_str);
+        VG_(emit)("[ERROR] Bad eviction policy provided: '%s'; Require 'RR', 'FLAT' or 'LRU' (not case sensitive)!\n", pmem.pmat_eviction_policy_str);
+        VG_(exit)(1);
+    }
+
+    if (VG_(strcasecmp)(pmem.pmat_store_stack_mode_str, "full") == 0) {
+        pmem.pmat_store_stack_mode = PMAT_STACK_FULL;
+    } else if (VG_(strcasecmp)(pmem.pmat_store_stack_mode_str, "ip") == 0) {
+        pmem.pmat_store_stack_mode = PMAT_STACK_IP;
+    } else if (VG_(strcasecmp)(pmem.pmat_store_stack_mode_str, "first") == 0) {
+        pmem.pmat_store_stack_mode = PMAT_STACK_FIRST;
+    } else if (VG_(strcasecmp)(pmem.pmat_store_stack_mode_str, "sampled") == 0) {
+        pmem.pmat_store_stack_mode = PMAT_STACK_SAMPLED;
+    } else {
+        VG_(emit)("[ERROR] Bad store stack mode provided: '%s'; Require 'full', 'ip', 'first' or 'sampled'!\n", pmem.pmat_store_stack_mode_str);
         VG_(exit)(1);
     }
     // Fill RNG Pool
@@ -2077,7 +3763,8 @@ pmat_print_usage(void)
             "                                      default [1048576]\n"
             "    --num-wb-entries=N                The maximum number of entries in the write-back reordering buffer\n"
             "                                      default [131072]\n"
-            "    --rng-seed=N                      The value of RNG seed used when simulating a crash or evicting entries\n"
+            "    --rng-seed=N                      The value of RNG seed used when simulating a crash, evicting entries or\n"
+            "                                      randomizing the scheduling quantum\n"
             "                                      default [/dev/urandom]\n"
             "    --preserve-bin-on-error=yes|no    Preserve the copy of the shadow region alongside .stderr, .stdout, and .dump files.\n"
             "                                      default [no]\n"
@@ -2085,8 +3772,50 @@ pmat_print_usage(void)
             "                                      default [no]\n"
             "    --terminate-on-error=yes|no       Terminates the program on the first error occurred, rather than continuing execution.\n"
             "                                      default [no]\n"
-            "    --eviction-policy=RR|LRU          Determines the eviction policy to be used.\n"
+            "    --inline-pmem-check=yes|no        Skip the store helper inline for stores that cannot touch a registered region.\n"
+            "                                      default [yes]\n"
+            "    --coalesce-stores=yes|no          Trace stores of a superblock to the same cache line off the same base\n"
+            "                                      address with one helper call. default [yes]\n"
+            "    --non-temporal-stores=yes|no      Keep non-temporal (MOVNT*) stores in a small per-thread write-combining\n"
+            "                                      buffer, drained on a fence, instead of the simulated cache. default [yes]\n"
+            "    --in-process-verification=yes|no  Verify a simulated crash by calling the functions passed to PMAT_REGISTER_WITH_FN\n"
+            "                                      in the forked process rather than executing --verifier; regions registered\n"
+            "                                      without one are not checked. Callbacks run natively, outside of Valgrind,\n"
+            "                                      on the crashing thread's TLS; see PMAT_REGISTER_WITH_FN in pmat.h.\n"
+            "                                      default [no]\n"
+            "    --verifier-jobs=N                 Verify up to N simulated crashes in the background while the program\n"
+            "                                      continues; 0 uses one job per core. Ignored with --aggregate-dump-only.\n"
+            "                                      Each job writes a copy of every shadow heap, but the program only pays\n"
+            "                                      for the fork and for copying the pages it modifies while the job runs;\n"
+            "                                      shadow heap files are only written on unregistering and on exit.\n"
+            "                                      default [1] (verify synchronously)\n"
+            "    --verifier-timeout=ms             Kill a verifier that runs for longer than this and report the crash as\n"
+            "                                      a failed verification that timed out.\n"
+            "                                      default [0] (no timeout)\n"
+            "    --dedup-verifications=<yes|no>    Skip verifying a crash whose shadow heaps are identical to those of a\n"
+            "                                      crash that already passed verification; default [no]\n"
+            "    --lazy-shadow=<yes|no>            Copy a registered region into its shadow heap a page at a time, before\n"
+            "                                      the first store to the page, instead of all at once; default [no]\n"
+            "    --lazy-instrumentation=<yes|no>   Leave code uninstrumented while no region is registered, translating\n"
+            "                                      it again on the first PMAT_REGISTER; default [no]\n"
+            "    --shadow-dir=<dir>                Directory to create shadow heaps and their copies in, e.g. /dev/shm;\n"
+            "                                      default [.]\n"
+            "    --shadow-memfd=<yes|no>           Keep shadow heaps in anonymous memory files, passed to the verifier\n"
+            "                                      as /proc/<pid>/fd/<fd>; copies still go to --shadow-dir; default [no]\n"
+            "    --record-crashes=<file>           Record the seed, scheduling options and the state at every simulated crash.\n"
+            "    --replay-crashes=<file>           Rerun a recorded run without running any verifier up to crash --replay-crash=N,\n"
+            "                                      then write N.dump and wait for gdb to attach (see --vgdb).\n"
+            "    --eviction-policy=RR|FLAT|LRU     Determines the eviction policy to be used.\n"
+            "                                      FLAT is random-replacement over an open-addressed table.\n"
             "                                      default [RR] (random-replacement).\n"
+            "    --store-stack-mode=full|ip|first|sampled\n"
+            "                                      Stack recorded for each store and flush: the full stack, only the\n"
+            "                                      instruction pointer, the full stack of only the first store to a\n"
+            "                                      cache line, or the full stack of a sampled fraction of them;\n"
+            "                                      default [full]\n"
+            "    --store-stack-depth=N             Number of frames in a full stack; default [0] (--num-callers)\n"
+            "    --store-stack-probability=p       The probability of recording a full stack with\n"
+            "                                      --store-stack-mode=sampled; default [0.1]\n"
             "    --randomize-quantum=yes|no        Whether the scheduling quantum should be randomized or not.\n"
             "                                      default [yes]\n"
             "    --scheduling-quantum=N            Number of blocks each thread will attempt to process per time quantum.\n"
@@ -2140,9 +3869,17 @@ static void scientificNotation(Double d, Double *norm, Word *exp) {
 static void
 pmat_fini(Int exitcode)
 {
-    if (pmem.pmat_verifier) {
+    // Leave complete shadow heaps behind
+    VG_(OSetGen_ResetIter)(pmem.pmat_registered_files);
+    struct pmat_registered_file *file;
+    while ((file = VG_(OSetGen_Next)(pmem.pmat_registered_files))) {
+        fill_unmaterialized(file);
+        sync_shadow_file(file);
+    }
+    if (has_verifier()) {
+        drain_verifier_jobs(False);
         print_store_stats();
-        if (pmem.num_verifications) {
+        if (pmem.num_timed_verifications) {
             Double mean, var, mins, maxs, stds;
             Word mean_norm, var_norm, mins_norm, maxs_norm, stds_norm;
             get_stats(&mean, &var);
@@ -2161,7 +3898,11 @@ pmat_fini(Int exitcode)
             if (pmem.pmat_aggregate_dump_only) dump_aggregate_to_file();
         }
     }
+    if (pmem.pmat_record_fd != -1) {
+        VG_(close)(pmem.pmat_record_fd);
+    }
     VG_(emit)("Executed %lu superblocks...\n", sblocks);
+    pmat_arena_print_stats();
 
 }
 
@@ -2186,6 +3927,9 @@ pmat_pre_clo_init(void)
 
     VG_(needs_client_requests)(pmat_handle_client_request);
 
+    VG_(track_start_client_code)(pmat_start_client_code);
+    VG_(track_pre_thread_ll_exit)(pmat_thread_exit);
+
     /* support only 64 bit architectures */
     tl_assert(VG_WORDSIZE == 8);
     tl_assert(sizeof(void*) == 8);
@@ -2194,7 +3938,9 @@ pmat_pre_clo_init(void)
     tl_assert(sizeof(Word) == 8);
 
     pmem.num_verifications = 0;
+    pmem.num_timed_verifications = 0;
     pmem.num_bad_verifications = 0;
+    pmem.num_timed_out_verifications = 0;
     pmem.min_verification_time = 0;
     pmem.max_verification_time = 0;
     pmem.ssd_verification_time = 0;
@@ -2207,8 +3953,26 @@ pmat_pre_clo_init(void)
     pmem.pmat_preserve_bin_on_error = False;
     pmem.pmat_aggregate_dump_only = False;
     pmem.pmat_terminate_on_error = False;
+    pmem.pmat_inline_pmem_check = True;
+    pmem.pmat_coalesce_stores = True;
+    pmem.pmat_non_temporal_stores = True;
+    pmem.pmat_in_process_verification = False;
+    pmem.pmat_verifier_jobs = 1;
+    pmem.pmat_verifier_timeout = 0;
+    pmem.pmat_record_file = NULL;
+    pmem.pmat_record_fd = -1;
+    pmem.pmat_replay_file = NULL;
+    pmem.pmat_replay_crash = 0;
+    pmem.pmat_dedup_verifications = False;
+    pmem.pmat_lazy_shadow = False;
+    pmem.pmat_shadow_dir = NULL;
+    pmem.pmat_shadow_memfd = False;
+    pmem.pmat_lazy_instrumentation = False;
+    pmem.num_deduplicated_verifications = 0;
     pmem.pmat_eviction_policy_str = "RR";
-    VG_(quantum_seed) = get_urandom();
+    pmem.pmat_store_stack_mode_str = "full";
+    pmem.pmat_store_stack_depth = 0;
+    pmem.pmat_store_stack_prob = 0.1;
     VG_(randomize_quantum) = True;
     VG_(scheduling_quantum) = 1000;
 }
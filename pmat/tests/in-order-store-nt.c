@@ -0,0 +1,38 @@
+/*
+    Test to determine whether or not non-temporal stores ordered by SFENCE alone
+    are seen as persisted; the same as in-order-store, but streaming with
+    MOVNTI instead of flushing. With --non-temporal-stores=no the stores stay
+    in the cache, and crashes fail once a later line is evicted ahead of an
+    earlier one (720 of 1024 with --rng-seed=3).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valgrind/pmat.h>
+#include <assert.h>
+#include <immintrin.h>
+#include "utils.h"
+
+#ifndef N
+#define N (1024)
+#endif
+#define SIZE (N * sizeof(int))
+
+int main(int argc, char *argv[]) {
+	PMAT_CRASH_DISABLE();
+
+	/* create a pmem file and memory map it */
+	int *arr = CREATE_HEAP("in-order-store-nt.bin", SIZE);
+	assert(arr != (void *) -1);
+	PMAT_REGISTER("in-order-store-nt-shadow.bin", arr, SIZE);
+
+	// Initialize array sequentially...
+	for (int i = 0; i < N; i++) {
+		_mm_stream_si32(arr + i, i);
+		SFENCE();
+		PMAT_FORCE_CRASH();
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+    Test to determine whether PMAT_IS_PERSIST only reports the bytes of a range
+    that are still pending: stored to but not yet written back, whether they
+    sit in the cache, in the write-back buffer after a flush, or in the
+    write-combining buffer after a non-temporal store. Random evictions can
+    write a line back early, so run with a fixed --rng-seed (see README.md).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valgrind/pmat.h>
+#include <assert.h>
+#include <immintrin.h>
+#include "utils.h"
+
+#define SIZE (4 * PMAT_CACHELINE_SIZE)
+#define STORE(addr, value) (*(volatile int *) (addr) = (value))
+
+int main(int argc, char *argv[]) {
+	PMAT_CRASH_DISABLE();
+	char *heap = CREATE_HEAP("is-persist.bin", 2 * SIZE);
+	assert(heap != (void *) -1);
+	// Two back-to-back regions
+	PMAT_REGISTER("is-persist-shadow.bin", heap, SIZE);
+	PMAT_REGISTER("is-persist-shadow2.bin", heap + SIZE, SIZE);
+	assert(PMAT_IS_PERSIST(heap, 2 * SIZE));
+
+	// Part of a line: only the bytes stored to are pending
+	char *line = heap;
+	STORE(line, 1);
+	assert(!PMAT_IS_PERSIST(line, sizeof(int)));
+	assert(PMAT_IS_PERSIST(line + 8, 8));
+	assert(!PMAT_IS_PERSIST(line, PMAT_CACHELINE_SIZE));
+
+	// Flushed but not fenced: pending until the fence
+	CLFLUSHOPT(line);
+	assert(!PMAT_IS_PERSIST(line, sizeof(int)));
+	SFENCE();
+	assert(PMAT_IS_PERSIST(line, PMAT_CACHELINE_SIZE));
+
+	// Flushed, then stored to again: one copy in each of the write-back buffer and the cache
+	line = heap + PMAT_CACHELINE_SIZE;
+	STORE(line, 2);
+	CLFLUSHOPT(line);
+	STORE(line + 32, 3);
+	assert(!PMAT_IS_PERSIST(line, sizeof(int)));
+	assert(!PMAT_IS_PERSIST(line + 32, sizeof(int)));
+	assert(PMAT_IS_PERSIST(line + 16, sizeof(int)));
+	SFENCE();
+	assert(PMAT_IS_PERSIST(line, sizeof(int)));
+	assert(!PMAT_IS_PERSIST(line + 32, sizeof(int)));
+	CLFLUSH(line);
+	assert(PMAT_IS_PERSIST(line, PMAT_CACHELINE_SIZE));
+
+	// Only in the write-combining buffer
+	line = heap + 2 * PMAT_CACHELINE_SIZE;
+	_mm_stream_si32((int *) (line + 4), 4);
+	assert(!PMAT_IS_PERSIST(line + 4, sizeof(int)));
+	assert(PMAT_IS_PERSIST(line, sizeof(int)));
+	SFENCE();
+	assert(PMAT_IS_PERSIST(line, PMAT_CACHELINE_SIZE));
+
+	// A range across several lines is pending if any of them is
+	line = heap + 3 * PMAT_CACHELINE_SIZE;
+	STORE(line + 8, 5);
+	assert(!PMAT_IS_PERSIST(heap + 8, SIZE - 8));
+	assert(PMAT_IS_PERSIST(heap + 8, 3 * PMAT_CACHELINE_SIZE));
+	CLFLUSH(line);
+	assert(PMAT_IS_PERSIST(heap, SIZE));
+
+	// Ranges past the end of a region, and from one region into the next
+	assert(PMAT_IS_PERSIST(heap, SIZE + 1));
+	assert(PMAT_IS_PERSIST(heap + SIZE, SIZE + 1));
+	line = heap + SIZE;
+	STORE(line + 8, 6);
+	assert(!PMAT_IS_PERSIST(heap + SIZE - 8, 32));
+	assert(!PMAT_IS_PERSIST(heap, 2 * SIZE + PMAT_CACHELINE_SIZE));
+	assert(PMAT_IS_PERSIST(heap, SIZE + 8));
+	CLFLUSH(line);
+	assert(PMAT_IS_PERSIST(heap, 2 * SIZE + PMAT_CACHELINE_SIZE));
+	return 0;
+}
@@ -60,8 +60,10 @@ static void check_queue(struct DurableQueue *dq) {
 // to memory reclamation we use.
 static void do_benchmark(struct DurableQueue *dq, int seconds) {
 	srand(0);
-	time_t start;
-	time(&start);
+	// time() only has a resolution of a second, which would cut the run short
+	// by up to a second depending on when in the second it started.
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	atomic_int status = 1; 
 	size_t numOperations = 0;
 
@@ -72,12 +74,12 @@ static void do_benchmark(struct DurableQueue *dq, int seconds) {
 		size_t threadSuperblocks = PMAT_SUPERBLOCKS_EXECUTED;
 		#pragma omp master
 		printf("Number of threads: %d\n", omp_get_num_threads());
-		time_t end;
+		struct timespec end;
 
 		while (true) {
 			{
-				time(&end);
-				int time_taken = end - start;
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
 				if (time_taken >= seconds) {
 					break;
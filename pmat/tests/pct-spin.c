@@ -0,0 +1,39 @@
+/*
+    Test to determine whether the PCT scheduler (--fair-sched=pct) lets every
+    thread make progress while the others spin waiting on it. The threads pass
+    a turn around, and each spins until it is its own, so the thread holding
+    the turn may well have the lowest priority of them all.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <omp.h>
+
+#ifndef THREADS
+#define THREADS (3)
+#endif
+#ifndef ROUNDS
+#define ROUNDS (8)
+#endif
+
+static volatile int turn;
+
+int main(int argc, char *argv[]) {
+	int threads = 0;
+	#pragma omp parallel num_threads(THREADS)
+	{
+		int self = omp_get_thread_num();
+		int n = omp_get_num_threads();
+		for (int round = 0; round < ROUNDS; round++) {
+			while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) % n != self);
+			__atomic_store_n(&turn, turn + 1, __ATOMIC_RELEASE);
+		}
+		#pragma omp single
+		threads = n;
+	}
+	printf("threads = %d, turns = %d\n", threads, turn);
+	assert(threads == THREADS);
+	assert(turn == THREADS * ROUNDS);
+	return 0;
+}
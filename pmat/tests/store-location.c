@@ -0,0 +1,35 @@
+/*
+    Test to determine whether stores traced together are reported at the line
+    that made them, rather than at a later instruction of the superblock. The
+    .dump must show the line of the stores in init_record (see README.md).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valgrind/pmat.h>
+#include <assert.h>
+#include "utils.h"
+
+struct record {
+	long a, b, c, d;
+};
+
+#define SIZE (sizeof(struct record))
+
+// The stores are traced together once the function returns...
+static void __attribute__((noinline)) init_record(struct record *r, long v) {
+	r->a = v; r->b = v + 1; r->c = v + 2; r->d = v + 3;
+}
+
+int main(int argc, char *argv[]) {
+	PMAT_CRASH_DISABLE();
+	struct record *r = CREATE_HEAP("store-location.bin", SIZE);
+	assert(r != (void *) -1);
+	PMAT_REGISTER("store-location-shadow.bin", r, SIZE);
+
+	init_record(r, 1);
+	// ...but must be reported at init_record, not here
+	PMAT_FORCE_CRASH();
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+    Fails unless the record of store-location was persisted, so that the .dump
+    shows where its stores were made.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valgrind/pmat.h>
+#include <assert.h>
+#include "utils.h"
+
+struct record {
+	long a, b, c, d;
+};
+
+int main(int argc, char *argv[]) {
+	assert(argc >= 3);
+	assert(strcmp(argv[1], "1") == 0);
+
+	int sz;
+	struct record *r = OPEN_HEAP(argv[2], O_RDONLY, &sz);
+	assert(r != (void *) -1);
+	int persisted = r->a == 1 && r->b == 2 && r->c == 3 && r->d == 4;
+	munmap(r, sz);
+
+	if (!persisted) {
+		fprintf(stderr, "Record was not persisted\n");
+		return PMAT_VERIFICATION_FAILURE;
+	}
+	return 0;
+}
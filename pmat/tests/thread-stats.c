@@ -0,0 +1,47 @@
+/*
+    Test to determine whether PMAT_THREAD_STATS counts the stores, flushes and
+    fences of the calling thread, and rejects a NULL buffer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valgrind/pmat.h>
+#include <assert.h>
+#include "utils.h"
+
+#ifndef N
+#define N (64)
+#endif
+#define SIZE (N * PMAT_CACHELINE_SIZE)
+
+int main(int argc, char *argv[]) {
+	PMAT_CRASH_DISABLE();
+	char *arr = CREATE_HEAP("thread-stats.bin", SIZE);
+	assert(arr != (void *) -1);
+	PMAT_REGISTER("thread-stats-shadow.bin", arr, SIZE);
+
+	pmat_thread_stats before, after;
+	assert(PMAT_THREAD_STATS(&before) == 0);
+
+	// One store, flush and fence per cache line...
+	for (int i = 0; i < N; i++) {
+		*(int *) (arr + i * PMAT_CACHELINE_SIZE) = i;
+		CLFLUSH(arr + i * PMAT_CACHELINE_SIZE);
+		SFENCE();
+	}
+
+	assert(PMAT_THREAD_STATS(&after) == 0);
+	printf("stores = %llu, flushes = %llu, fences = %llu, superblocks = %llu\n",
+		after.stores - before.stores, after.flushes - before.flushes,
+		after.fences - before.fences, after.superblocks - before.superblocks);
+	assert(after.stores - before.stores == N);
+	assert(after.flushes - before.flushes == N);
+	// CLFLUSH is ordered like a flush followed by a fence
+	assert(after.fences - before.fences == 2 * N);
+	assert(after.superblocks > before.superblocks);
+
+	// Must be refused rather than written through
+	assert(PMAT_THREAD_STATS(NULL) == -1);
+	return 0;
+}